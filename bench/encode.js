@@ -0,0 +1,288 @@
+// End to end encode benchmarks over the test corpus and generated images.
+//
+//   node bench/encode.js [--time ms] [--concurrency n] [--only pattern] [--json]
+//
+// Every case is a target (Png, FixedPngStack, DynamicPngStack), sync or async,
+// an image set and an option set. Each runs for about --time milliseconds
+// after a warm up and reports images/s, input MB/s, p50/p99 latency and the
+// compression ratio (PNG bytes / pixel bytes). Async cases keep --concurrency
+// encodes in flight. --only runs the cases whose name contains pattern, and
+// --json prints one JSON object per case instead of the table, for diffing
+// runs against each other.
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+var path = require('path');
+var Buffer = require('buffer').Buffer;
+
+var args = process.argv.slice(2);
+function arg(name, def) {
+    var i = args.indexOf('--' + name);
+    if (i < 0)
+        return def;
+    return typeof def == 'boolean' ? true : args[i + 1];
+}
+
+var TIME = parseInt(arg('time', '1000'), 10);
+var CONCURRENCY = parseInt(arg('concurrency', '4'), 10);
+var ONLY = arg('only', '');
+var JSON_OUT = arg('json', false);
+
+var root = path.join(__dirname, '..');
+
+// Images ---------------------------------------------------------------------
+
+function image(name, data, w, h, type) {
+    return { name: name, data: data, width: w, height: h, type: type || 'rgba' };
+}
+
+function gradient(w, h) {
+    var buf = new Buffer(w * h * 4);
+    for (var y = 0; y < h; y++) {
+        for (var x = 0; x < w; x++) {
+            var i = (y * w + x) * 4;
+            buf[i] = x * 255 / w;
+            buf[i + 1] = y * 255 / h;
+            buf[i + 2] = (x + y) * 127 / (w + h);
+            buf[i + 3] = 0;
+        }
+    }
+    return image('gradient-' + w + 'x' + h, buf, w, h);
+}
+
+function noise(w, h) {
+    var buf = new Buffer(w * h * 4), seed = 12345;
+    for (var i = 0; i < buf.length; i++) {
+        seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+        buf[i] = (i & 3) == 3 ? 0 : seed >> 16;
+    }
+    return image('noise-' + w + 'x' + h, buf, w, h);
+}
+
+// Flat panels with a few colors and rows of glyph-like marks, roughly what a
+// desktop or terminal capture looks like.
+function screenshot(w, h) {
+    var buf = new Buffer(w * h * 4);
+    var panels = [[0xF0, 0xF0, 0xF0], [0x2B, 0x2B, 0x2B], [0xFF, 0xFF, 0xFF], [0x3C, 0x78, 0xD8]];
+    for (var y = 0; y < h; y++) {
+        for (var x = 0; x < w; x++) {
+            var i = (y * w + x) * 4;
+            var c = panels[((x / 320) | 0) % 2 + (y < 40 ? 2 : 0)];
+            var glyph = y % 16 > 3 && y % 16 < 13 && x % 8 < 5 && ((x * 7 + y * 3) % 11) < 6;
+            buf[i] = glyph ? 255 - c[0] : c[0];
+            buf[i + 1] = glyph ? 255 - c[1] : c[1];
+            buf[i + 2] = glyph ? 255 - c[2] : c[2];
+            buf[i + 3] = 0;
+        }
+    }
+    return image('screenshot-' + w + 'x' + h, buf, w, h);
+}
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] };
+}
+
+var pushDir = path.join(root, 'tests', 'push-data');
+var fragments = fs.readdirSync(pushDir).sort().map(function (file) {
+    var dim = rectDim(file);
+    dim.data = fs.readFileSync(path.join(pushDir, file));
+    return dim;
+});
+
+var terminal = image('terminal-720x400',
+    fs.readFileSync(path.join(root, 'examples', 'rgba-terminal.dat')), 720, 400);
+
+var images = [terminal];
+[64, 256, 1024].forEach(function (size) {
+    images.push(gradient(size, size), noise(size, size), screenshot(size, size));
+});
+images.push(screenshot(1920, 1080));
+
+// Option sets ----------------------------------------------------------------
+
+var optionSets = [
+    { name: 'default', opts: {} },
+    { name: 'fast', opts: { level: 1, filters: 'up' } },
+    { name: 'level9', opts: { level: 9 } },
+    { name: 'threads', opts: { threads: 0 } },
+    { name: 'reduce', opts: { reduce: true } },
+    { name: 'palette', opts: { palette: true } }
+];
+['libdeflate', 'zlib-ng'].forEach(function (backend) {
+    try {
+        new PngLib.Png(new Buffer(4), 1, 1, 'rgba').encodeSync({ backend: backend });
+        optionSets.push({ name: backend, opts: { backend: backend } });
+    }
+    catch (e) {
+        // Not built in.
+    }
+});
+
+// Targets --------------------------------------------------------------------
+
+// Each target sets up an object for an input and returns the number of pixel
+// bytes an encode of it takes in.
+var targets = {
+    'png': {
+        inputs: images,
+        make: function (img) {
+            return {
+                obj: new PngLib.Png(img.data, img.width, img.height, img.type),
+                bytes: img.data.length
+            };
+        }
+    },
+    'fixed-stack': {
+        inputs: [{ name: 'push-data-720x400' }],
+        make: function () {
+            var stack = new PngLib.FixedPngStack(720, 400, 'rgba');
+            fragments.forEach(function (f) {
+                stack.push(f.data, f.x, f.y, f.w, f.h);
+            });
+            return { obj: stack, bytes: 720 * 400 * 4 };
+        }
+    },
+    'dynamic-stack': {
+        inputs: [{ name: 'push-data' }],
+        make: function () {
+            var stack = new PngLib.DynamicPngStack('rgba');
+            fragments.forEach(function (f) {
+                stack.push(f.data, f.x, f.y, f.w, f.h);
+            });
+            stack.encodeSync();
+            var dim = stack.dimensions();
+            return { obj: stack, bytes: dim.width * dim.height * 4 };
+        }
+    }
+};
+
+// Measurement ----------------------------------------------------------------
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;
+}
+
+function percentile(sorted, p) {
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function report(name, bytes, latencies, elapsed, outBytes) {
+    latencies.sort(function (a, b) { return a - b; });
+    var n = latencies.length;
+    var result = {
+        name: name,
+        images: n,
+        imagesPerSec: n * 1000 / elapsed,
+        mbPerSec: n * bytes / 1048576 / (elapsed / 1000),
+        p50: percentile(latencies, 0.5),
+        p99: percentile(latencies, 0.99),
+        ratio: outBytes / (n * bytes)
+    };
+
+    if (JSON_OUT) {
+        console.log(JSON.stringify(result));
+        return;
+    }
+    console.log(pad(name, 52) +
+        pad(result.imagesPerSec.toFixed(1), 10, true) +
+        pad(result.mbPerSec.toFixed(1), 9, true) +
+        pad(result.p50.toFixed(2), 9, true) +
+        pad(result.p99.toFixed(2), 9, true) +
+        pad(result.ratio.toFixed(3), 8, true));
+}
+
+function pad(s, n, left) {
+    s = String(s);
+    while (s.length < n)
+        s = left ? ' ' + s : s + ' ';
+    return s;
+}
+
+function runSync(name, t, opts, done) {
+    for (var i = 0; i < 3; i++)
+        t.obj.encodeSync(opts);
+
+    var latencies = [], outBytes = 0, start = now(), end = start + TIME;
+    while (now() < end) {
+        var s = now();
+        outBytes += t.obj.encodeSync(opts).length;
+        latencies.push(now() - s);
+    }
+    report(name, t.bytes, latencies, now() - start, outBytes);
+    done();
+}
+
+function runAsync(name, t, opts, done) {
+    var latencies = [], outBytes = 0, inFlight = 0, start, end, warm = 3;
+
+    function next() {
+        if (now() >= end) {
+            if (inFlight == 0) {
+                report(name, t.bytes, latencies, now() - start, outBytes);
+                done();
+            }
+            return;
+        }
+        var s = now();
+        inFlight++;
+        t.obj.encode(opts, function (png, a, b) {
+            // DynamicPngStack passes dimensions before the error.
+            var err = png ? null : (a instanceof Error ? a : b);
+            inFlight--;
+            if (err)
+                throw err;
+            latencies.push(now() - s);
+            outBytes += png.length;
+            next();
+        });
+    }
+
+    // A few sequential encodes first, so threads and pools are warm.
+    (function warmUp() {
+        if (warm-- == 0) {
+            start = now();
+            end = start + TIME;
+            for (var i = 0; i < CONCURRENCY; i++)
+                next();
+            return;
+        }
+        t.obj.encode(opts, function () { warmUp(); });
+    })();
+}
+
+// Cases ----------------------------------------------------------------------
+
+var cases = [];
+Object.keys(targets).forEach(function (targetName) {
+    var target = targets[targetName];
+    target.inputs.forEach(function (input) {
+        optionSets.forEach(function (set) {
+            ['sync', 'async'].forEach(function (mode) {
+                var name = [targetName, mode, input.name, set.name].join(' ');
+                if (ONLY && name.indexOf(ONLY) < 0)
+                    return;
+                cases.push({ name: name, target: target, input: input, opts: set.opts, mode: mode });
+            });
+        });
+    });
+});
+
+if (!JSON_OUT) {
+    console.log(pad('case', 52) + pad('img/s', 10, true) + pad('MB/s', 9, true) +
+        pad('p50 ms', 9, true) + pad('p99 ms', 9, true) + pad('ratio', 8, true));
+}
+
+(function runNext(i) {
+    if (i == cases.length)
+        return;
+    var c = cases[i];
+    var t = c.target.make(c.input);
+    var run = c.mode == 'sync' ? runSync : runAsync;
+    run(c.name, t, c.opts, function () {
+        setImmediate(function () { runNext(i + 1); });
+    });
+})(0);
@@ -0,0 +1,88 @@
+// Micro-benchmarks of the pixel conversions: pushes that add an alpha
+// channel, and encodes whose rows are swizzled or have their alpha inverted
+// for the PNG, at level 0 so that deflate doesn't hide them.
+//
+//   node bench/pixels.js [--time ms]
+//
+// Each case runs with the vector kernels the CPU has, then again in a child
+// process with NODE_PNG_KERNELS=plain, which runs the plain loops instead.
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var child_process = require('child_process');
+
+var args = process.argv.slice(2);
+var i = args.indexOf('--time');
+var TIME = i >= 0 ? parseInt(args[i + 1], 10) : 500;
+
+var WIDTH = 1920, HEIGHT = 1080;
+
+function pixels(channels) {
+    var buf = new Buffer(WIDTH * HEIGHT * channels);
+    for (var j = 0; j < buf.length; j++)
+        buf[j] = (j * 31) & 0xFF;
+    return buf;
+}
+
+function pushCase(type, channels) {
+    var buf = pixels(channels);
+    var stack = new PngLib.FixedPngStack(WIDTH, HEIGHT, type);
+    return function () {
+        stack.push(buf, 0, 0, WIDTH, HEIGHT);
+    };
+}
+
+function encodeCase(type, channels) {
+    var png = new PngLib.Png(pixels(channels), WIDTH, HEIGHT, type);
+    return function () {
+        png.encodeSync({ level: 0, filters: 'none' });
+    };
+}
+
+var cases = [
+    ['push rgb', pushCase('rgb', 3)],
+    ['push gray', pushCase('gray', 1)],
+    ['encode bgr', encodeCase('bgr', 3)],
+    ['encode rgba', encodeCase('rgba', 4)],
+    ['encode bgra', encodeCase('bgra', 4)],
+    ['encode graya', encodeCase('graya', 2)]
+];
+
+// Milliseconds per call, the best of the batches run in TIME ms.
+function measure(fn) {
+    fn();
+    var best = Infinity, end = Date.now() + TIME;
+    while (Date.now() < end) {
+        var start = process.hrtime();
+        fn();
+        var t = process.hrtime(start);
+        best = Math.min(best, t[0] * 1e3 + t[1] / 1e6);
+    }
+    return best;
+}
+
+var results = cases.map(function (c) {
+    return measure(c[1]);
+});
+
+if (process.env.NODE_PNG_KERNELS == 'plain') {
+    console.log(JSON.stringify(results));
+}
+else {
+    var env = {};
+    for (var k in process.env)
+        env[k] = process.env[k];
+    env.NODE_PNG_KERNELS = 'plain';
+    child_process.execFile(process.execPath, [__filename, '--time', String(TIME)], { env: env },
+        function (err, stdout) {
+            if (err)
+                throw err;
+            var plain = JSON.parse(stdout);
+            console.log('case             kernels ms   plain ms');
+            cases.forEach(function (c, j) {
+                var name = (c[0] + '                ').slice(0, 16);
+                var fast = ('          ' + results[j].toFixed(2)).slice(-10);
+                var slow = ('          ' + plain[j].toFixed(2)).slice(-10);
+                console.log(name + ' ' + fast + ' ' + slow);
+            });
+        });
+}
@@ -0,0 +1,34 @@
+// Encodes many small images with and without the pooled libpng contexts.
+//   node bench/small-encodes.js [count]
+var Png = require('../build/Release/png').Png;
+var Buffer = require('buffer').Buffer;
+
+var count = parseInt(process.argv[2] || '20000', 10);
+var sizes = [16, 64, 256];
+
+function image(size) {
+    var buf = new Buffer(size * size * 4);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = ((i >> 2) % size) ^ Math.floor(i / (4 * size)) ^ (i & 3) * 40;
+    return new Png(buf, size, size, 'rgba');
+}
+
+function run(png, n, reuse) {
+    var opts = { level: 1, filters: 'up', reuseContext: reuse };
+    png.encodeSync(opts);
+    var start = process.hrtime();
+    for (var i = 0; i < n; i++)
+        png.encodeSync(opts);
+    var t = process.hrtime(start);
+    return (t[0] * 1e6 + t[1] / 1e3) / n;
+}
+
+sizes.forEach(function (size) {
+    var png = image(size);
+    var n = size > 64 ? Math.ceil(count / 10) : count;
+    var fresh = run(png, n, false);
+    var pooled = run(png, n, true);
+    console.log(size + 'x' + size + ': ' + fresh.toFixed(1) + ' us fresh, ' +
+        pooled.toFixed(1) + ' us pooled (' +
+        Math.round(100 * (1 - pooled / fresh)) + '% saved)');
+});
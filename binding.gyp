@@ -1,17 +1,49 @@
 {
+    "variables": {
+        "with_libdeflate%": "false",
+        "with_zlib_ng%": "false"
+    },
     "targets": [
         {
             "target_name": "png",
             "sources": [
                 "src/common.cpp",
+                "src/blend.cpp",
+                "src/pixel_convert.cpp",
+                "src/encode_options.cpp",
+                "src/encode_stats.cpp",
                 "src/png_encoder.cpp",
+                "src/png_stream.cpp",
+                "src/encoder_pool.cpp",
+                "src/parallel_deflate.cpp",
+                "src/strip_cache.cpp",
+                "src/png_filter.cpp",
+                "src/compressor.cpp",
+                "src/quantize.cpp",
+                "src/reduce.cpp",
+                "src/png_buffer.cpp",
+                "src/png_context_pool.cpp",
                 "src/png.cpp",
+                "src/batch_encode.cpp",
                 "src/fixed_png_stack.cpp",
                 "src/dynamic_png_stack.cpp",
+                "src/incremental_png.cpp",
                 "src/module.cpp",
             ],
             "include_dirs" : ["<!(node -p -e \"require('path').dirname(require.resolve('nan'))\")"],
             "conditions" : [
+                [
+                    'with_libdeflate=="true"', {
+                        "defines" : [ "HAVE_LIBDEFLATE" ],
+                        "libraries" : [ "-ldeflate" ]
+                    }
+                ],
+                [
+                    'with_zlib_ng=="true"', {
+                        "defines" : [ "HAVE_ZLIB_NG" ],
+                        "libraries" : [ "-lz-ng" ]
+                    }
+                ],
                 [
                     'OS=="linux"', {
                         "libraries" : [
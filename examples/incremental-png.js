@@ -0,0 +1,25 @@
+var IncrementalPng = require('../build/Release/png').IncrementalPng;
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+
+var WIDTH = 400, HEIGHT = 300, BAND = 25;
+
+// Render a gradient one band at a time, never holding the full image.
+var band = new Buffer(WIDTH * BAND * 3);
+var inc = new IncrementalPng();
+inc.begin(WIDTH, HEIGHT, 'rgb', { level: 6 });
+
+for (var y0 = 0; y0 < HEIGHT; y0 += BAND) {
+    for (var y = 0; y < BAND; y++) {
+        for (var x = 0; x < WIDTH; x++) {
+            var i = (y * WIDTH + x) * 3;
+            band[i] = Math.floor(255 * x / WIDTH);
+            band[i+1] = Math.floor(255 * (y0 + y) / HEIGHT);
+            band[i+2] = 128;
+        }
+    }
+    inc.writeRows(band, BAND);
+}
+
+var png = inc.end();
+fs.writeFileSync('./png-incremental.png', png.toString('binary'), 'binary');
@@ -0,0 +1,33 @@
+var fs  = require('fs');
+var Readable = require('stream').Readable;
+var Png = require('../build/Release/png').Png;
+
+// Wraps a streaming encode in a Readable stream, so the PNG can be piped
+// to a file or an HTTP response while it's still being compressed.
+function pngStream(png, options) {
+    var stream = new Readable();
+    var started = false;
+
+    stream._read = function () {
+        if (started) return;
+        started = true;
+
+        options.stream = true;
+        png.encode(options, function (chunk, error) {
+            if (error) {
+                stream.emit('error', error);
+                return;
+            }
+            stream.push(chunk);
+        });
+    };
+
+    return stream;
+}
+
+// the rgba-terminal.dat file is 1152000 bytes long.
+var rgba = fs.readFileSync('./rgba-terminal.dat');
+
+var png = new Png(rgba, 720, 400, 'rgba');
+pngStream(png, { chunkSize: 8192 }).pipe(fs.createWriteStream('./png-stream.png'));
+
@@ -0,0 +1,369 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "batch_encode.h"
+#include "encoder_pool.h"
+
+using namespace v8;
+using namespace node;
+
+BatchEncoder::BatchEncoder(std::vector<BatchImage> &iimages) :
+    images(iimages), next(0)
+{
+    uv_mutex_init(&lock);
+}
+
+BatchEncoder::~BatchEncoder()
+{
+    uv_mutex_destroy(&lock);
+}
+
+void
+BatchEncoder::encode_images()
+{
+    for (;;) {
+        uv_mutex_lock(&lock);
+        size_t i = next++;
+        uv_mutex_unlock(&lock);
+        if (i >= images.size())
+            return;
+
+        BatchImage &img = images[i];
+        try {
+            uint64_t start = uv_hrtime();
+            PngEncoder encoder(img.data, img.width, img.height, img.buf_type, img.opts);
+            encoder.encode();
+            img.stats = encoder.get_stats();
+            img.stats.total_ns = uv_hrtime() - start;
+            img.png_len = encoder.get_png_len();
+            img.png = encoder.release_png();
+        }
+        catch (const char *err) {
+            img.errmsg = err;
+        }
+    }
+}
+
+class BatchTask : public PoolTask {
+    BatchEncoder *batch;
+
+public:
+    BatchTask(BatchEncoder *bbatch) : batch(bbatch) {}
+    void run() { batch->encode_images(); }
+};
+
+void
+BatchEncoder::run(int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = EncoderPool::size();
+    if ((size_t)nthreads > images.size())
+        nthreads = images.size();
+
+    // Each task keeps taking images until there are none left, so a batch
+    // never occupies more than nthreads of the pool's threads.
+    std::vector<BatchTask> tasks(nthreads, BatchTask(this));
+    std::vector<PoolTask *> task_ptrs;
+    for (int i = 0; i < nthreads; i++)
+        task_ptrs.push_back(&tasks[i]);
+    if (nthreads > 0)
+        EncoderPool::run_all(&task_ptrs[0], nthreads);
+}
+
+const char *
+BatchEncoder::error(int &index) const
+{
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].errmsg) {
+            index = i;
+            return images[i].errmsg;
+        }
+    }
+    return NULL;
+}
+
+static void
+free_batch(std::vector<BatchImage> &images)
+{
+    for (size_t i = 0; i < images.size(); i++) {
+        free(images[i].png);
+        images[i].png = NULL;
+    }
+}
+
+static const char *
+batch_error(int index, const char *err, char *msg, size_t msg_len)
+{
+    snprintf(msg, msg_len, "Image %d: %s", index, err);
+    return msg;
+}
+
+// The PNGs of the batch as an array of Buffers, which take over their memory.
+// Adds each image's stats to the process-wide ones. An image's total is the
+// time of its own encode and output, plus its queue wait, so that the
+// totals don't count the batch's time once per image.
+static Local<Array>
+batch_result(std::vector<BatchImage> &images)
+{
+    NanScope();
+
+    Local<Array> result = Array::New(images.size());
+    for (size_t i = 0; i < images.size(); i++) {
+        uint64_t t = uv_hrtime();
+        result->Set(i, PngEncoder::png_buffer(images[i].png, images[i].png_len));
+        images[i].png = NULL;
+
+        EncodeStats &stats = images[i].stats;
+        stats.output_ns = uv_hrtime() - t;
+        stats.total_ns += stats.queue_ns + stats.output_ns;
+        record_encode(stats);
+    }
+    return scope.Close(result);
+}
+
+static Local<Array>
+batch_stats(const std::vector<BatchImage> &images)
+{
+    NanScope();
+
+    Local<Array> result = Array::New(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+        result->Set(i, stats_object(images[i].stats));
+    return scope.Close(result);
+}
+
+static bool
+parse_buffer_type(Handle<Value> val, buffer_type &buf_type)
+{
+    if (val->IsUndefined()) {
+        buf_type = BUF_RGB;
+        return true;
+    }
+    if (!val->IsString())
+        return false;
+
+    String::AsciiValue bts(val->ToString());
+    if (str_eq(*bts, "rgb"))
+        buf_type = BUF_RGB;
+    else if (str_eq(*bts, "bgr"))
+        buf_type = BUF_BGR;
+    else if (str_eq(*bts, "rgba"))
+        buf_type = BUF_RGBA;
+    else if (str_eq(*bts, "bgra"))
+        buf_type = BUF_BGRA;
+    else if (str_eq(*bts, "gray"))
+        buf_type = BUF_GRAY;
+    else if (str_eq(*bts, "graya"))
+        buf_type = BUF_GRAYA;
+    else
+        return false;
+    return true;
+}
+
+// Reads the batch options and the { data, width, height, type, options }
+// objects of the images array, and sets each image's data Buffer in
+// buffers. Returns NULL on success or an error message, written to msg if
+// it names an image.
+static const char *
+parse_batch(Handle<Value> images_val, Handle<Value> opts_val, std::vector<BatchImage> &images,
+    Handle<Array> buffers, int &nthreads, char *msg, size_t msg_len)
+{
+    if (!images_val->IsArray())
+        return "First argument must be an array of images.";
+
+    EncodeOptions defaults;
+    const char *err = parse_encode_options(opts_val, defaults);
+    if (err)
+        return err;
+
+    nthreads = 0;
+    if (opts_val->IsObject()) {
+        Local<Object> opts = opts_val->ToObject();
+        if (opts->Has(String::NewSymbol("parallel"))) {
+            Local<Value> parallel = opts->Get(String::NewSymbol("parallel"));
+            if (!parallel->IsInt32() || parallel->Int32Value() < 0)
+                return "Option parallel must be a non-negative integer.";
+            nthreads = parallel->Int32Value();
+        }
+    }
+
+    Handle<Array> arr = Handle<Array>::Cast(images_val);
+    images.resize(arr->Length());
+    for (uint32_t i = 0; i < arr->Length(); i++) {
+        BatchImage &img = images[i];
+        Local<Value> el = arr->Get(i);
+        err = NULL;
+
+        if (!el->IsObject()) {
+            err = "must be an object with data, width and height.";
+        }
+        else {
+            Local<Object> obj = el->ToObject();
+            Local<Value> data = obj->Get(String::NewSymbol("data"));
+            Local<Value> width = obj->Get(String::NewSymbol("width"));
+            Local<Value> height = obj->Get(String::NewSymbol("height"));
+
+            img.opts = defaults;
+            if (!Buffer::HasInstance(data))
+                err = "data must be a Buffer.";
+            else if (!width->IsInt32() || width->Int32Value() < 0)
+                err = "width must be a non-negative integer.";
+            else if (!height->IsInt32() || height->Int32Value() < 0)
+                err = "height must be a non-negative integer.";
+            else if (!parse_buffer_type(obj->Get(String::NewSymbol("type")), img.buf_type))
+                err = "type must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.";
+            else
+                err = parse_encode_options(obj->Get(String::NewSymbol("options")), img.opts);
+
+            if (!err) {
+                buffers->Set(i, data);
+                img.data = (unsigned char *)Buffer::Data(data);
+                img.width = width->Int32Value();
+                img.height = height->Int32Value();
+                if (Buffer::Length(data) < (size_t)img.width * img.height * buffer_channels(img.buf_type))
+                    err = "data is smaller than width*height pixels.";
+                else if (img.opts.stream)
+                    err = "the stream option can't be used in a batch.";
+            }
+        }
+
+        if (err) {
+            snprintf(msg, msg_len, "Image %u: %s", i, err);
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+BatchEncodeWorker::~BatchEncodeWorker()
+{
+    free_batch(images);
+}
+
+void
+BatchEncodeWorker::Execute()
+{
+    BatchEncoder batch(images);
+    batch.run(nthreads);
+
+    // The batch waited for a thread once, which is counted in its first
+    // image.
+    if (queued_at && !images.empty())
+        images[0].stats.queue_ns = started_at - queued_at;
+
+    int index;
+    const char *err = batch.error(index);
+    if (err) {
+        char msg[256];
+        errmsg = strdup(batch_error(index, err, msg, sizeof(msg)));
+    }
+}
+
+void
+BatchEncodeWorker::HandleOKCallback()
+{
+    NanScope();
+
+    Local<Array> pngs = batch_result(images);
+    Local<Value> argv[3] = {pngs, Undefined(), batch_stats(images)};
+
+    TryCatch try_catch;
+
+    callback->Call(3, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+}
+
+void
+BatchEncodeWorker::HandleErrorCallback()
+{
+    NanScope();
+
+    record_failed_encode();
+
+    Local<Value> argv[2] = {Undefined(), Exception::Error(String::New(errmsg))};
+
+    TryCatch try_catch;
+
+    callback->Call(2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+}
+
+void
+InitializeBatchEncode(Handle<Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "encodeBatch", BatchEncodeAsync);
+    NODE_SET_METHOD(target, "encodeBatchSync", BatchEncodeSync);
+}
+
+NAN_METHOD(BatchEncodeSync)
+{
+    NanScope();
+
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("Array of images required, optionally followed by options.");
+
+    std::vector<BatchImage> images;
+    int nthreads;
+    char msg[256];
+    Handle<Value> opts = args.Length() == 2 ? args[1] : Handle<Value>(Undefined());
+    const char *err = parse_batch(args[0], opts, images, Array::New(), nthreads, msg, sizeof(msg));
+    if (err)
+        return NanThrowTypeError(err);
+
+    BatchEncoder batch(images);
+    batch.run(nthreads);
+
+    int index;
+    err = batch.error(index);
+    if (err) {
+        free_batch(images);
+        record_failed_encode();
+        return NanThrowError(batch_error(index, err, msg, sizeof(msg)));
+    }
+
+    NanReturnValue(batch_result(images));
+}
+
+NAN_METHOD(BatchEncodeAsync)
+{
+    NanScope();
+
+    if (args.Length() != 2 && args.Length() != 3)
+        return NanThrowError("Array of images and callback function required, optionally with options in between.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
+
+    if (EncoderPool::full())
+        return NanThrowError("Too many encodes pending, see setMaxPendingEncodes.");
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+
+    std::vector<BatchImage> images;
+    int nthreads;
+    char msg[256];
+    Handle<Value> opts = args.Length() == 3 ? args[1] : Handle<Value>(Undefined());
+    Local<Array> buffers = Array::New();
+    const char *err = parse_batch(args[0], opts, images, buffers, nthreads, msg, sizeof(msg));
+    if (err)
+        return NanThrowTypeError(err);
+
+    BatchEncodeWorker *worker = new BatchEncodeWorker(new NanCallback(callback), images, nthreads);
+
+    // The image Buffers must outlive the encode. The worker holds on to
+    // the Buffers themselves, as the caller may still replace them in the
+    // images array.
+    Local<Object> buffers_obj = buffers;
+    worker->SavePersistent("buffers", buffers_obj);
+    unsigned int id = EncoderPool::queue_worker(worker);
+
+    NanReturnValue(Integer::NewFromUnsigned(id));
+}
+
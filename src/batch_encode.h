@@ -0,0 +1,74 @@
+#ifndef BATCH_ENCODE_H
+#define BATCH_ENCODE_H
+
+#include <vector>
+
+#include <node.h>
+#include <node_buffer.h>
+
+#include "common.h"
+#include "png_encoder.h"
+#include "encoder_pool.h"
+
+struct BatchImage {
+    unsigned char *data;
+    int width, height;
+    buffer_type buf_type;
+    EncodeOptions opts;
+
+    char *png;            // the result, malloc'd, until taken over
+    int png_len;
+    const char *errmsg;
+    EncodeStats stats;
+
+    BatchImage() : data(NULL), width(0), height(0), buf_type(BUF_RGB),
+        png(NULL), png_len(0), errmsg(NULL) {}
+};
+
+// Encodes a list of images, handing them out to up to nthreads threads one
+// image at a time, so that a batch of small images costs one dispatch
+// instead of one per image. Failures are recorded per image.
+class BatchEncoder {
+    std::vector<BatchImage> &images;
+    size_t next;
+    uv_mutex_t lock;
+
+public:
+    BatchEncoder(std::vector<BatchImage> &iimages);
+    ~BatchEncoder();
+
+    // Encodes the images that no other thread has taken yet.
+    void encode_images();
+
+    // Encodes on the calling thread and nthreads - 1 threads of the encoder
+    // pool, 0 for all of them.
+    void run(int nthreads);
+
+    // The first failure in the batch, or NULL.
+    const char *error(int &index) const;
+};
+
+class BatchEncodeWorker : public PoolWorker {
+    std::vector<BatchImage> images;
+    int nthreads;
+
+public:
+    BatchEncodeWorker(NanCallback *callback, const std::vector<BatchImage> &iimages, int nnthreads) :
+        PoolWorker(callback), images(iimages), nthreads(nnthreads) {
+        for (size_t i = 0; i < images.size(); i++)
+            images[i].opts.cancel = cancel_flag();
+    }
+    ~BatchEncodeWorker();
+
+    void Execute();
+    void HandleOKCallback();
+    void HandleErrorCallback();
+};
+
+void InitializeBatchEncode(v8::Handle<v8::Object> target);
+
+NAN_METHOD(BatchEncodeSync);
+NAN_METHOD(BatchEncodeAsync);
+
+#endif
+
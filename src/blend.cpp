@@ -0,0 +1,214 @@
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blend.h"
+
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+// Source-over in floats, with alpha from 0 (transparent) to 255:
+//
+//   k = da * (255 - sa) / 255          what's left of dst's alpha
+//   oa = sa + k
+//   oc = (sc * sa + dc * k) / oa       sc * 255 if sc is premultiplied
+//
+// The vector kernels do the same operations in the same order, so they give
+// exactly the bytes the plain loop does. A transparent source pixel leaves
+// dst alone, an opaque one comes out as itself.
+static const float INV_255 = 1.0f / 255.0f;
+
+static inline void
+blend_pixel(const unsigned char *s, unsigned char *d, int channels, bool premultiplied)
+{
+    int a = channels - 1;
+    if (s[a] == 0xFF)
+        return;
+    if (s[a] == 0) {
+        memcpy(d, s, channels);
+        return;
+    }
+
+    float sa = (float)(255 - s[a]);
+    float da = (float)(255 - d[a]);
+    float k = da * (255.0f - sa) * INV_255;
+    float oa = sa + k;
+    float f = premultiplied ? 255.0f : sa;
+    for (int c = 0; c < a; c++) {
+        int v = (int)(((float)s[c] * f + (float)d[c] * k) / oa + 0.5f);
+        d[c] = v > 255 ? 255 : v;
+    }
+    d[a] = 255 - (int)(oa + 0.5f);
+}
+
+static void
+blend_4ch_plain(const unsigned char *src, unsigned char *dst, int npixels, bool premultiplied)
+{
+    for (int i = 0; i < npixels; i++)
+        blend_pixel(src + i*4, dst + i*4, 4, premultiplied);
+}
+
+#ifdef __SSE2__
+// One pixel, its channels in the lanes of s and d with alpha in lane 3 and
+// not inverted.
+static inline __m128i
+blend_4ch_sse2_pixel(__m128 s, __m128 d, bool premultiplied)
+{
+    const __m128 c255 = _mm_set1_ps(255.0f);
+    const __m128 alpha_lane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+    __m128 sa = _mm_shuffle_ps(s, s, 0xFF);
+    __m128 da = _mm_shuffle_ps(d, d, 0xFF);
+    __m128 k = _mm_mul_ps(_mm_mul_ps(da, _mm_sub_ps(c255, sa)), _mm_set1_ps(INV_255));
+    __m128 oa = _mm_add_ps(sa, k);
+    __m128 f = premultiplied ? c255 : sa;
+    __m128 v = _mm_div_ps(_mm_add_ps(_mm_mul_ps(s, f), _mm_mul_ps(d, k)), oa);
+    v = _mm_or_ps(_mm_and_ps(alpha_lane, oa), _mm_andnot_ps(alpha_lane, v));
+    return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+}
+
+static void
+blend_4ch_sse2(const unsigned char *src, unsigned char *dst, int npixels, bool premultiplied)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    int i = 0;
+
+    for (; i + 4 <= npixels; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i*4));
+        __m128i sa = _mm_and_si128(s, alpha_mask);
+        __m128i transparent = _mm_cmpeq_epi32(sa, alpha_mask);
+        if (_mm_movemask_epi8(transparent) == 0xFFFF)
+            continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)(dst + i*4), s);
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i*4));
+        __m128i s16 = _mm_unpacklo_epi8(_mm_xor_si128(s, alpha_mask), zero);
+        __m128i d16 = _mm_unpacklo_epi8(_mm_xor_si128(d, alpha_mask), zero);
+        __m128i p0 = blend_4ch_sse2_pixel(_mm_cvtepi32_ps(_mm_unpacklo_epi16(s16, zero)),
+            _mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, zero)), premultiplied);
+        __m128i p1 = blend_4ch_sse2_pixel(_mm_cvtepi32_ps(_mm_unpackhi_epi16(s16, zero)),
+            _mm_cvtepi32_ps(_mm_unpackhi_epi16(d16, zero)), premultiplied);
+        s16 = _mm_unpackhi_epi8(_mm_xor_si128(s, alpha_mask), zero);
+        d16 = _mm_unpackhi_epi8(_mm_xor_si128(d, alpha_mask), zero);
+        __m128i p2 = blend_4ch_sse2_pixel(_mm_cvtepi32_ps(_mm_unpacklo_epi16(s16, zero)),
+            _mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, zero)), premultiplied);
+        __m128i p3 = blend_4ch_sse2_pixel(_mm_cvtepi32_ps(_mm_unpackhi_epi16(s16, zero)),
+            _mm_cvtepi32_ps(_mm_unpackhi_epi16(d16, zero)), premultiplied);
+
+        // The packs saturate colors of bad premultiplied pixels to 255.
+        __m128i out = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        out = _mm_xor_si128(out, alpha_mask);
+        out = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, out));
+        _mm_storeu_si128((__m128i *)(dst + i*4), out);
+    }
+    blend_4ch_plain(src + i*4, dst + i*4, npixels - i, premultiplied);
+}
+#endif
+
+#ifdef HAVE_CPU_DISPATCH
+// blend_4ch_sse2_pixel() for two pixels, one in each 128-bit lane.
+__attribute__((target("avx2"))) static inline __m256i
+blend_4ch_avx2_pixels(__m256 s, __m256 d, bool premultiplied)
+{
+    const __m256 c255 = _mm256_set1_ps(255.0f);
+    const __m256 alpha_lane = _mm256_castsi256_ps(_mm256_set_epi32(-1, 0, 0, 0, -1, 0, 0, 0));
+
+    __m256 sa = _mm256_shuffle_ps(s, s, 0xFF);
+    __m256 da = _mm256_shuffle_ps(d, d, 0xFF);
+    __m256 k = _mm256_mul_ps(_mm256_mul_ps(da, _mm256_sub_ps(c255, sa)), _mm256_set1_ps(INV_255));
+    __m256 oa = _mm256_add_ps(sa, k);
+    __m256 f = premultiplied ? c255 : sa;
+    __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(s, f), _mm256_mul_ps(d, k)), oa);
+    v = _mm256_blendv_ps(v, oa, alpha_lane);
+    return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+}
+
+__attribute__((target("avx2"))) static void
+blend_4ch_avx2(const unsigned char *src, unsigned char *dst, int npixels, bool premultiplied)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+    // The packs below leave the pixels in the order 0 2 4 6 1 3 5 7.
+    const __m256i unshuffle = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+
+    for (; i + 8 <= npixels; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i*4));
+        __m256i sa = _mm256_and_si256(s, alpha_mask);
+        __m256i transparent = _mm256_cmpeq_epi32(sa, alpha_mask);
+        if (_mm256_movemask_epi8(transparent) == -1)
+            continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, zero)) == -1) {
+            _mm256_storeu_si256((__m256i *)(dst + i*4), s);
+            continue;
+        }
+
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i*4));
+        __m256i st = _mm256_xor_si256(s, alpha_mask);
+        __m256i dt = _mm256_xor_si256(d, alpha_mask);
+        __m128i s_lo = _mm256_castsi256_si128(st), s_hi = _mm256_extracti128_si256(st, 1);
+        __m128i d_lo = _mm256_castsi256_si128(dt), d_hi = _mm256_extracti128_si256(dt, 1);
+        __m256i p01 = blend_4ch_avx2_pixels(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(s_lo)),
+            _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(d_lo)), premultiplied);
+        __m256i p23 = blend_4ch_avx2_pixels(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(s_lo, 8))),
+            _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(d_lo, 8))), premultiplied);
+        __m256i p45 = blend_4ch_avx2_pixels(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(s_hi)),
+            _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(d_hi)), premultiplied);
+        __m256i p67 = blend_4ch_avx2_pixels(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(s_hi, 8))),
+            _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(d_hi, 8))), premultiplied);
+
+        __m256i out = _mm256_packus_epi16(_mm256_packs_epi32(p01, p23), _mm256_packs_epi32(p45, p67));
+        out = _mm256_permutevar8x32_epi32(out, unshuffle);
+        out = _mm256_xor_si256(out, alpha_mask);
+        out = _mm256_blendv_epi8(out, d, transparent);
+        _mm256_storeu_si256((__m256i *)(dst + i*4), out);
+    }
+    blend_4ch_plain(src + i*4, dst + i*4, npixels - i, premultiplied);
+}
+#endif
+
+typedef void (*blend_4ch_fn)(const unsigned char *src, unsigned char *dst, int npixels,
+    bool premultiplied);
+
+static blend_4ch_fn
+pick_blend_4ch()
+{
+    int features = cpu_features();
+#ifdef HAVE_CPU_DISPATCH
+    if (features & CPU_AVX2)
+        return blend_4ch_avx2;
+#endif
+#ifdef __SSE2__
+    if (features & CPU_SSE2)
+        return blend_4ch_sse2;
+#endif
+    return blend_4ch_plain;
+}
+
+// Picked once, while the module loads and before any encode thread runs.
+static const blend_4ch_fn blend_4ch = pick_blend_4ch();
+
+void blend_pixels(const unsigned char *src, buffer_type src_type,
+    unsigned char *dst, buffer_type dst_type, int npixels, blend_mode blend)
+{
+    int channels = buffer_channels(src_type);
+    if (blend == BLEND_NONE || src_type != dst_type || channels == 1 || channels == 3) {
+        copy_pixels(src, src_type, dst, dst_type, npixels);
+        return;
+    }
+
+    bool premultiplied = blend == BLEND_OVER_PREMULTIPLIED;
+    if (channels == 4) {
+        blend_4ch(src, dst, npixels, premultiplied);
+        return;
+    }
+    for (int i = 0; i < npixels; i++)
+        blend_pixel(src + i*2, dst + i*2, 2, premultiplied);
+}
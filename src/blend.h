@@ -0,0 +1,15 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include "common.h"
+#include "encode_options.h"
+
+// Puts npixels pixels of src on dst the way blend says. Alpha is inverted
+// in both, as everywhere in node-png, and dst is src_type, or src_type plus
+// alpha as for copy_pixels(). Pixels without alpha are opaque, so they're
+// copied whatever blend is. Four channel pixels are blended with the widest
+// vector instructions the CPU has, giving the same bytes as the plain loop.
+void blend_pixels(const unsigned char *src, buffer_type src_type,
+    unsigned char *dst, buffer_type dst_type, int npixels, blend_mode blend);
+
+#endif
@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <cassert>
 #include "common.h"
+#include "pixel_convert.h"
 
 using namespace v8;
 
@@ -9,3 +10,75 @@ bool str_eq(const char *s1, const char *s2)
     return strcmp(s1, s2) == 0;
 }
 
+int buffer_channels(buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+    case BUF_BGR:
+        return 3;
+    case BUF_GRAY:
+        return 1;
+    case BUF_GRAYA:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+buffer_type with_alpha(buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        return BUF_RGBA;
+    case BUF_BGR:
+        return BUF_BGRA;
+    case BUF_GRAY:
+        return BUF_GRAYA;
+    default:
+        return buf_type;
+    }
+}
+
+void copy_pixels(const unsigned char *src, buffer_type src_type,
+    unsigned char *dst, buffer_type dst_type, int npixels)
+{
+    int src_channels = buffer_channels(src_type);
+    int dst_channels = buffer_channels(dst_type);
+
+    if (src_channels == dst_channels)
+        memcpy(dst, src, (size_t)npixels * src_channels);
+    else
+        add_alpha(src, src_type, dst, npixels);
+}
+
+int cpu_count()
+{
+    uv_cpu_info_t *cpu_infos;
+    int count = 0;
+    uv_cpu_info(&cpu_infos, &count);
+    if (count > 0)
+        uv_free_cpu_info(cpu_infos, count);
+    return count > 0 ? count : 1;
+}
+
+
+int cpu_features()
+{
+    const char *kernels = getenv("NODE_PNG_KERNELS");
+    if (kernels && str_eq(kernels, "plain"))
+        return 0;
+
+    int features = 0;
+#ifdef __SSE2__
+    features |= CPU_SSE2;
+#endif
+#ifdef HAVE_CPU_DISPATCH
+    // May run from static initializers, before libgcc has looked.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        features |= CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= CPU_AVX2;
+#endif
+    return features;
+}
@@ -4,6 +4,20 @@
 #include <node.h>
 #include <cstring>
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Kernels for instruction sets beyond what the build targets are compiled
+// with target attributes and picked at run time. Older compilers don't
+// allow intrinsics in such functions.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_CPU_DISPATCH
+#endif
+
 struct Point {
     int x, y;
     Point() {}
@@ -19,7 +33,25 @@ struct Rect {
 
 bool str_eq(const char *s1, const char *s2);
 
-typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_GRAY } buffer_type;
+typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_GRAY, BUF_GRAYA } buffer_type;
+
+int buffer_channels(buffer_type buf_type);
+
+// The layout of buf_type with an alpha channel added, if it has none.
+buffer_type with_alpha(buffer_type buf_type);
+
+// Copies npixels pixels from src to dst, adding an opaque alpha channel if
+// dst_type is src_type plus alpha.
+void copy_pixels(const unsigned char *src, buffer_type src_type,
+    unsigned char *dst, buffer_type dst_type, int npixels);
+int cpu_count();
+
+// The vector instruction sets pixel kernels may use on this CPU: SSE2 if
+// the build targets it, SSSE3 and AVX2 if HAVE_CPU_DISPATCH and the CPU
+// (and OS) support them. NODE_PNG_KERNELS=plain in the environment makes
+// it 0, so that the plain loops run instead.
+enum { CPU_SSE2 = 1, CPU_SSSE3 = 2, CPU_AVX2 = 4 };
+int cpu_features();
 
 #endif
 
@@ -0,0 +1,125 @@
+#include "compressor.h"
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_ZLIB_NG
+#include <cstring>
+#include <png.h>
+#include <zlib-ng.h>
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+// libdeflate compresses whole buffers only, which is how it's used here
+// anyway. It has no strategies; its levels go to 12, but 0-9 mean about
+// what they mean to zlib. Its CRC-32 and Adler-32 use SIMD where available.
+class LibdeflateCompressor : public Compressor {
+    struct libdeflate_compressor *c;
+
+public:
+    LibdeflateCompressor(const EncodeOptions &opts) {
+        c = libdeflate_alloc_compressor(opts.level >= 0 ? opts.level : 6);
+        if (!c)
+            throw "libdeflate_alloc_compressor failed.";
+    }
+
+    ~LibdeflateCompressor() {
+        libdeflate_free_compressor(c);
+    }
+
+    size_t bound(size_t len) {
+        return libdeflate_zlib_compress_bound(c, len);
+    }
+
+    size_t compress(const unsigned char *in, size_t len, unsigned char *out) {
+        size_t out_len = libdeflate_zlib_compress(c, in, len, out, bound(len));
+        if (!out_len)
+            throw "libdeflate_zlib_compress failed.";
+        return out_len;
+    }
+
+    unsigned long crc32(unsigned long crc, const unsigned char *data, size_t len) {
+        return libdeflate_crc32(crc, data, len);
+    }
+};
+#endif
+
+#ifdef HAVE_ZLIB_NG
+// zlib-ng through its native zng_ API, so it can live next to the system
+// zlib libpng is linked with.
+class ZlibNgCompressor : public Compressor {
+    zng_stream zs;
+
+public:
+    ZlibNgCompressor(const EncodeOptions &opts) {
+        memset(&zs, 0, sizeof(zs));
+        int level = opts.level >= 0 ? opts.level : Z_DEFAULT_COMPRESSION;
+        int filters = opts.filters ? opts.filters : PNG_ALL_FILTERS;
+        int strategy = opts.strategy;
+        if (strategy < 0)
+            strategy = filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        if (zng_deflateInit2(&zs, level, Z_DEFLATED, MAX_WBITS, 8, strategy) != Z_OK)
+            throw "zng_deflateInit2 failed.";
+    }
+
+    ~ZlibNgCompressor() {
+        zng_deflateEnd(&zs);
+    }
+
+    size_t bound(size_t len) {
+        return zng_deflateBound(&zs, len);
+    }
+
+    size_t compress(const unsigned char *in, size_t len, unsigned char *out) {
+        zs.next_in = in;
+        zs.avail_in = len;
+        zs.next_out = out;
+        zs.avail_out = bound(len);
+        if (zng_deflate(&zs, Z_FINISH) != Z_STREAM_END)
+            throw "zng_deflate failed.";
+        return zs.total_out;
+    }
+
+    unsigned long crc32(unsigned long crc, const unsigned char *data, size_t len) {
+        return zng_crc32_z(crc, data, len);
+    }
+};
+#endif
+
+Compressor *
+Compressor::create(const EncodeOptions &opts)
+{
+    switch (opts.backend) {
+#ifdef HAVE_LIBDEFLATE
+    case BACKEND_LIBDEFLATE:
+        return new LibdeflateCompressor(opts);
+#endif
+#ifdef HAVE_ZLIB_NG
+    case BACKEND_ZLIB_NG:
+        return new ZlibNgCompressor(opts);
+#endif
+    default:
+        throw "Compression backend not available in this build of node-png.";
+    }
+}
+
+bool
+Compressor::available(compress_backend backend)
+{
+    switch (backend) {
+    case BACKEND_ZLIB:
+        return true;
+#ifdef HAVE_LIBDEFLATE
+    case BACKEND_LIBDEFLATE:
+        return true;
+#endif
+#ifdef HAVE_ZLIB_NG
+    case BACKEND_ZLIB_NG:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
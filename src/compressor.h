@@ -0,0 +1,34 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <cstddef>
+
+#include "encode_options.h"
+
+// A deflate implementation that compresses the filtered image data in one
+// go. zlib itself is used through libpng and needs none; the others are
+// compiled in when node-png is configured with them (see README). Throws
+// const char * on failure.
+class Compressor {
+public:
+    virtual ~Compressor() {}
+
+    // The largest zlib stream len bytes can compress to.
+    virtual size_t bound(size_t len) = 0;
+
+    // Compresses len bytes of in into a complete zlib stream in out, which
+    // has room for bound(len) bytes, and returns the stream's length.
+    virtual size_t compress(const unsigned char *in, size_t len, unsigned char *out) = 0;
+
+    // CRC-32 as used for PNG chunks, continuing from crc.
+    virtual unsigned long crc32(unsigned long crc, const unsigned char *data, size_t len) = 0;
+
+    // Creates the compressor for opts.backend with opts' level and strategy.
+    static Compressor *create(const EncodeOptions &opts);
+
+    // Whether node-png was built with the given backend.
+    static bool available(compress_backend backend);
+};
+
+#endif
+
@@ -1,47 +1,278 @@
+#include <algorithm>
+
 #include "png_encoder.h"
+#include "blend.h"
+#include "encoder_pool.h"
 #include "dynamic_png_stack.h"
 
 using namespace v8;
 using namespace node;
 
+// Reads the copy option: whether push copies the buffer (the default) or
+// keeps a reference to it.
+static const char *
+parse_copy_option(Handle<Value> val, bool &copy)
+{
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    if (!obj->Has(String::NewSymbol("copy")))
+        return NULL;
+
+    Local<Value> c = obj->Get(String::NewSymbol("copy"));
+    if (!c->IsBoolean())
+        return "Option copy must be true or false.";
+    copy = c->BooleanValue();
+    return NULL;
+}
+
+// Rows per bucket of the row index, the same as PngEncoder's bands so that a
+// band overlaps at most two buckets.
+static const int BUCKET_ROWS = CANCEL_CHECK_ROWS;
+
 std::pair<Point, Point>
 DynamicPngStack::optimal_dimension()
 {
-    Point top(-1, -1), bottom(-1, -1);
-    for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it) {
-        Png *png = *it;
-        if (top.x == -1 || png->x < top.x)
-            top.x = png->x;
-        if (top.y == -1 || png->y < top.y)
-            top.y = png->y;
-        if (bottom.x == -1 || png->x + png->w > bottom.x)
-            bottom.x = png->x + png->w;
-        if (bottom.y == -1 || png->y + png->h > bottom.y)
-            bottom.y = png->y + png->h;
+    return std::make_pair(bbox_top, bbox_bot);
+}
+
+DynamicPngStack::Snapshot
+DynamicPngStack::snapshot()
+{
+    std::pair<Point, Point> optimal = optimal_dimension();
+    Snapshot snap;
+    snap.top = optimal.first;
+    snap.width = optimal.second.x - optimal.first.x;
+    snap.height = optimal.second.y - optimal.first.y;
+    snap.pngs = png_stack;
+    return snap;
+}
+
+// Adds png_stack[i] to the bounding box and the row index.
+void
+DynamicPngStack::index_png(int i)
+{
+    Png *png = png_stack[i];
+    if (bbox_top.x == -1 || png->x < bbox_top.x)
+        bbox_top.x = png->x;
+    if (bbox_top.y == -1 || png->y < bbox_top.y)
+        bbox_top.y = png->y;
+    if (bbox_bot.x == -1 || png->x + png->w > bbox_bot.x)
+        bbox_bot.x = png->x + png->w;
+    if (bbox_bot.y == -1 || png->y + png->h > bbox_bot.y)
+        bbox_bot.y = png->y + png->h;
+
+    if (png->w == 0 || png->h == 0)
+        return;
+    int last = (png->y + png->h - 1) / BUCKET_ROWS;
+    for (int b = png->y / BUCKET_ROWS; b <= last; b++)
+        row_index[b].push_back(i);
+}
+
+// The indexes of the pushes that overlap rows y to y + nrows, in push order.
+// pngs is png_stack or a snapshot of it.
+void
+DynamicPngStack::pngs_in_rows(const vPng &pngs, int y, int nrows, std::vector<int> &found)
+{
+    found.clear();
+    if (nrows <= 0)
+        return;
+
+    RowIndex::iterator it = row_index.lower_bound(y / BUCKET_ROWS);
+    RowIndex::iterator end = row_index.upper_bound((y + nrows - 1) / BUCKET_ROWS);
+    for (; it != end; ++it) {
+        const std::vector<int> &bucket = it->second;
+        for (size_t i = 0; i < bucket.size(); i++) {
+            Png *png = pngs[bucket[i]];
+            if (png->y < y + nrows && png->y + png->h > y)
+                found.push_back(bucket[i]);
+        }
+    }
+
+    // A push that spans buckets is listed in each of them.
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+}
+
+// Drops the pushes that png, about to be pushed, covers completely: they
+// would never show. Not if png is blended, since they show through it then.
+// No encode is reading them, as pushes are refused while one runs.
+void
+DynamicPngStack::drop_covered(const Png *png)
+{
+    if (png->blend != BLEND_NONE || png->w == 0 || png->h == 0)
+        return;
+
+    std::vector<int> found;
+    pngs_in_rows(png_stack, png->y, png->h, found);
+    for (size_t i = 0; i < found.size(); i++) {
+        Png *under = png_stack[found[i]];
+        if (under->x < png->x || under->y < png->y ||
+            under->x + under->w > png->x + png->w || under->y + under->h > png->y + png->h)
+            continue;
+
+        int last = (under->y + under->h - 1) / BUCKET_ROWS;
+        for (int b = under->y / BUCKET_ROWS; b <= last; b++) {
+            std::vector<int> &bucket = row_index[b];
+            bucket.erase(std::lower_bound(bucket.begin(), bucket.end(), found[i]));
+            if (bucket.empty())
+                row_index.erase(b);
+        }
+        if (under->buffer.IsEmpty()) {
+            pushed_bytes -= under->len;
+            V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t)under->len);
+        }
+        delete under;
+        png_stack[found[i]] = NULL;
+    }
+}
+
+typedef std::vector<std::pair<int, int> > Spans;
+
+// Adds each span of [x0, x1) that spans doesn't cover to gaps. spans is
+// sorted and its spans don't touch.
+static void
+find_gaps(const Spans &spans, int x0, int x1, Spans &gaps)
+{
+    gaps.clear();
+    int at = x0;
+    for (size_t i = 0; i < spans.size() && spans[i].first < x1; i++) {
+        if (spans[i].second <= at)
+            continue;
+        if (spans[i].first > at)
+            gaps.push_back(std::make_pair(at, spans[i].first));
+        at = spans[i].second;
     }
+    if (at < x1)
+        gaps.push_back(std::make_pair(at, x1));
+}
 
-    return std::make_pair(top, bottom);
+// find_gaps(), then adds [x0, x1) to spans.
+static void
+cover_span(Spans &spans, int x0, int x1, Spans &gaps)
+{
+    find_gaps(spans, x0, x1, gaps);
+
+    // Spans first to last touch [x0, x1) and merge with it.
+    size_t first = 0;
+    while (first < spans.size() && spans[first].second < x0)
+        first++;
+    size_t last = first;
+    std::pair<int, int> merged(x0, x1);
+    for (; last < spans.size() && spans[last].first <= x1; last++) {
+        if (spans[last].first < merged.first)
+            merged.first = spans[last].first;
+        if (spans[last].second > merged.second)
+            merged.second = spans[last].second;
+    }
+    spans.erase(spans.begin() + first, spans.begin() + last);
+    spans.insert(spans.begin() + first, merged);
 }
 
+// Part of a row of a blended push, blended once what's under it is there.
+struct BlendSpan {
+    const unsigned char *src;
+    int x0, x1;
+    blend_mode blend;
+};
+
+// Composes rows y to y + nrows of snap's image. Each row is filled from the
+// last push down, and a push only fills what the pushes above it left
+// uncovered, so that every pixel is copied once, by the push that shows.
+// Blended pushes don't cover anything: the parts of them that show are
+// blended on top once the rest of the row is done, from the lowest up.
 void
-DynamicPngStack::construct_png_data(unsigned char *data, Point &top)
+DynamicPngStack::compose_rows(const Snapshot &snap, unsigned char *rows, int y, int nrows)
 {
-    for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it) {
-        Png *png = *it;
-        int start = (png->y - top.y)*width*4 + (png->x - top.x)*4;
-        unsigned char *pngdatap = png->data;
-        for (int i = 0; i < png->h; i++) {
-            unsigned char *datap = &data[start + i*width*4];
-            for (int j = 0; j < png->w; j++) {
-                *datap++ = *pngdatap++;
-                *datap++ = *pngdatap++;
-                *datap++ = *pngdatap++;
-                *datap++ = (buf_type == BUF_RGB || buf_type == BUF_BGR) ? 0x00 : *pngdatap++;
+    int channels = buffer_channels(canvas_type);
+    int png_channels = buffer_channels(buf_type);
+
+    int band_top = snap.top.y + y;
+    std::vector<int> found;
+    pngs_in_rows(snap.pngs, band_top, nrows, found);
+
+    Spans spans, gaps;
+    std::vector<BlendSpan> blends;
+    for (int r = 0; r < nrows; r++) {
+        int row_y = band_top + r;
+        unsigned char *row = rows + (size_t)r*snap.width*channels;
+        spans.clear();
+        blends.clear();
+
+        for (size_t i = found.size(); i-- > 0; ) {
+            Png *png = snap.pngs[found[i]];
+            if (row_y < png->y || row_y >= png->y + png->h)
+                continue;
+            int x0 = png->x - snap.top.x;
+            if (png->blend == BLEND_NONE)
+                cover_span(spans, x0, x0 + png->w, gaps);
+            else
+                find_gaps(spans, x0, x0 + png->w, gaps);
+
+            const unsigned char *src = png->data + (size_t)(row_y - png->y)*png->w*png_channels;
+            for (size_t g = 0; g < gaps.size(); g++) {
+                const unsigned char *gap_src = src + (size_t)(gaps[g].first - x0)*png_channels;
+                if (png->blend == BLEND_NONE) {
+                    copy_pixels(gap_src, buf_type, row + (size_t)gaps[g].first*channels,
+                        canvas_type, gaps[g].second - gaps[g].first);
+                }
+                else {
+                    BlendSpan b = { gap_src, gaps[g].first, gaps[g].second, png->blend };
+                    blends.push_back(b);
+                }
             }
         }
+
+        // What no push covers is transparent.
+        cover_span(spans, 0, snap.width, gaps);
+        for (size_t g = 0; g < gaps.size(); g++) {
+            memset(row + (size_t)gaps[g].first*channels, 0xFF,
+                (size_t)(gaps[g].second - gaps[g].first)*channels);
+        }
+
+        for (size_t b = blends.size(); b-- > 0; ) {
+            blend_pixels(blends[b].src, buf_type, row + (size_t)blends[b].x0*channels,
+                canvas_type, blends[b].x1 - blends[b].x0, blends[b].blend);
+        }
     }
 }
 
+class StackRows : public RowSource {
+    DynamicPngStack *stack;
+    const DynamicPngStack::Snapshot &snap;
+
+public:
+    StackRows(DynamicPngStack *sstack, const DynamicPngStack::Snapshot &ssnap) :
+        stack(sstack), snap(ssnap) {}
+
+    void read_rows(unsigned char *rows, int y, int nrows) {
+        stack->compose_rows(snap, rows, y, nrows);
+    }
+};
+
+// The whole composed image, for options that can't be fed rows as they're
+// composed, or NULL if rows can be. Throws if out of memory.
+unsigned char *
+DynamicPngStack::compose_canvas(const Snapshot &snap, const EncodeOptions &eopts)
+{
+    if (PngEncoder::can_stream_rows(eopts))
+        return NULL;
+
+    size_t rowbytes = (size_t)snap.width * buffer_channels(canvas_type);
+    unsigned char *data = (unsigned char*)malloc(sizeof(*data) * rowbytes * snap.height);
+    if (!data)
+        throw "malloc failed in node-png (DynamicPngStack::compose_canvas).";
+
+    // In bands, as for a RowSource, so that each row only goes through the
+    // pushes of the row index buckets around it.
+    for (int y = 0; y < snap.height; y += BUCKET_ROWS) {
+        int nrows = snap.height - y < BUCKET_ROWS ? snap.height - y : BUCKET_ROWS;
+        compose_rows(snap, data + (size_t)y*rowbytes, y, nrows);
+    }
+    return data;
+}
+
 void
 DynamicPngStack::Initialize(Handle<Object> target)
 {
@@ -53,26 +284,67 @@ DynamicPngStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", Reset);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
     target->Set(String::NewSymbol("DynamicPngStack"), t->GetFunction());
 }
 
-DynamicPngStack::DynamicPngStack(buffer_type bbuf_type) :
-    buf_type(bbuf_type) {}
+DynamicPngStack::DynamicPngStack(buffer_type bbuf_type, buffer_type ccanvas_type,
+    const EncodeOptions &oopts, bool ccopy_pushes, blend_mode bblend) :
+    bbox_top(-1, -1), bbox_bot(-1, -1), buf_type(bbuf_type), canvas_type(ccanvas_type), opts(oopts),
+    pushed_bytes(0), copy_pushes(ccopy_pushes), blend(bblend), disposed(false), encoding(0) {}
 
 DynamicPngStack::~DynamicPngStack()
+{
+    free_pngs();
+}
+
+void
+DynamicPngStack::free_pngs()
 {
     for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it)
         delete *it;
+    png_stack.clear();
+    row_index.clear();
+    bbox_top = bbox_bot = Point(-1, -1);
+    V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t)pushed_bytes);
+    pushed_bytes = 0;
+}
+
+// A disposed stack keeps its pushes until the last encode reading them is
+// done.
+void
+DynamicPngStack::encode_done()
+{
+    if (--encoding == 0 && disposed)
+        free_pngs();
 }
 
 Handle<Value>
-DynamicPngStack::Push(unsigned char *buf_data, size_t buf_len, int x, int y, int w, int h)
+DynamicPngStack::Push(Handle<Object> buf, bool copy, blend_mode push_blend, int x, int y, int w, int h)
 {
     NanScope();
 
+    if (!copy) {
+        Png *png = new Png(buf, push_blend, x, y, w, h);
+        drop_covered(png);
+        png_stack.push_back(png);
+        index_png(png_stack.size() - 1);
+        return scope.Close(Undefined());
+    }
+
     try {
-        Png *png = new Png(buf_data, buf_len, x, y, w, h);
+        size_t buf_len = Buffer::Length(buf);
+        Png *png = new Png((unsigned char *)Buffer::Data(buf), buf_len, push_blend, x, y, w, h);
+        drop_covered(png);
         png_stack.push_back(png);
+        index_png(png_stack.size() - 1);
+
+        // So that V8 collects stacks nobody uses any more before the copies
+        // run the process out of memory.
+        pushed_bytes += buf_len;
+        V8::AdjustAmountOfExternalAllocatedMemory(buf_len);
         return scope.Close(Undefined());
     }
     catch (const char *e) {
@@ -81,35 +353,43 @@ DynamicPngStack::Push(unsigned char *buf_data, size_t buf_len, int x, int y, int
 }
 
 Handle<Value>
-DynamicPngStack::PngEncodeSync()
+DynamicPngStack::PngEncodeSync(const EncodeOptions &eopts, Handle<Object> output)
 {
     NanScope();
 
-    std::pair<Point, Point> optimal = optimal_dimension();
-    Point top = optimal.first, bot = optimal.second;
-
-    offset = top;
-    width = bot.x - top.x;
-    height = bot.y - top.y;
-
-    unsigned char *data = (unsigned char*)malloc(sizeof(*data) * width * height * 4);
-    if (!data) return ThrowException(Exception::Error(String::New("malloc failed in DynamicPngStack::PngEncode")));
-    memset(data, 0xFF, width*height*4);
-
-    construct_png_data(data, top);
-
-    buffer_type pbt = (buf_type == BUF_BGR || buf_type == BUF_BGRA) ? BUF_BGRA : BUF_RGBA;
+    uint64_t start = uv_hrtime();
+    Snapshot snap = snapshot();
+    offset = snap.top;
+    width = snap.width;
+    height = snap.height;
 
+    unsigned char *data = NULL;
+    StackRows rows(this, snap);
     try {
-        PngEncoder encoder(data, width, height, pbt);
+        data = compose_canvas(snap, eopts);
+        uint64_t composed = uv_hrtime();
+
+        PngEncoder encoder(data, snap.width, snap.height, canvas_type, eopts);
+        if (!data)
+            encoder.set_row_source(&rows);
+        if (!output.IsEmpty())
+            encoder.set_output(Buffer::Data(output), Buffer::Length(output));
         encoder.encode();
         free(data);
-        int png_len = encoder.get_png_len();
-        Local<Object> retbuf = NanNewBufferHandle(png_len);
-        memcpy(Buffer::Data(retbuf), encoder.get_png(), png_len);
-        return scope.Close(retbuf);
+        uint64_t encoded = uv_hrtime();
+        Local<Object> buf = encoder.get_buffer(output);
+
+        last_stats = encoder.get_stats();
+        if (data)
+            last_stats.compose_ns = composed - start;
+        last_stats.output_ns = uv_hrtime() - encoded;
+        last_stats.total_ns = uv_hrtime() - start;
+        record_encode(last_stats);
+        return scope.Close(buf);
     }
     catch (const char *err) {
+        free(data);
+        record_failed_encode();
         return ThrowException(Exception::Error(String::New(err)));
     }
 }
@@ -133,17 +413,11 @@ NAN_METHOD(DynamicPngStack::New)
     NanScope();
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 1) {
+    if (args.Length() >= 1 && !args[0]->IsUndefined()) {
         if (!args[0]->IsString())
-            return NanThrowTypeError("First argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("First argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
 
         String::AsciiValue bts(args[0]->ToString());
-        if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
-            str_eq(*bts, "rgba") || str_eq(*bts, "bgra")))
-        {
-            return NanThrowTypeError("First argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
-        }
-
         if (str_eq(*bts, "rgb"))
             buf_type = BUF_RGB;
         else if (str_eq(*bts, "bgr"))
@@ -152,11 +426,31 @@ NAN_METHOD(DynamicPngStack::New)
             buf_type = BUF_RGBA;
         else if (str_eq(*bts, "bgra"))
             buf_type = BUF_BGRA;
+        else if (str_eq(*bts, "gray"))
+            buf_type = BUF_GRAY;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
         else
-            return NanThrowTypeError("First argument wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("First argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
     }
 
-    DynamicPngStack *png_stack = new DynamicPngStack(buf_type);
+    EncodeOptions opts;
+    buffer_type canvas_type = with_alpha(buf_type);
+    bool copy = true;
+    blend_mode blend = BLEND_NONE;
+    if (args.Length() >= 2) {
+        const char *err = parse_encode_options(args[1], opts);
+        if (!err)
+            err = parse_canvas_option(args[1], buf_type, canvas_type);
+        if (!err)
+            err = parse_copy_option(args[1], copy);
+        if (!err)
+            err = parse_blend_option(args[1], blend);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
+    DynamicPngStack *png_stack = new DynamicPngStack(buf_type, canvas_type, opts, copy, blend);
     png_stack->Wrap(args.This());
     NanReturnValue(args.This());
 }
@@ -191,12 +485,22 @@ NAN_METHOD(DynamicPngStack::Push)
         return NanThrowRangeError("Height smaller than 0.");
 
     DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    if (png_stack->disposed)
+        return NanThrowError("DynamicPngStack has been disposed.");
+    if (png_stack->encoding)
+        return NanThrowError("Can't push while an encode is running.");
+
+    bool copy = png_stack->copy_pushes;
+    blend_mode blend = png_stack->blend;
+    if (args.Length() >= 6) {
+        const char *err = parse_copy_option(args[5], copy);
+        if (!err)
+            err = parse_blend_option(args[5], blend);
+        if (err)
+            return NanThrowTypeError(err);
+    }
 
-    Local<Object> buf_obj = args[0].As<Object>();
-    char *buf_data = Buffer::Data(buf_obj);
-    size_t buf_len = Buffer::Length(buf_obj);
-
-    NanReturnValue(png_stack->Push((unsigned char*)buf_data, buf_len, x, y, w, h));
+    NanReturnValue(png_stack->Push(args[0].As<Object>(), copy, blend, x, y, w, h));
 }
 
 NAN_METHOD(DynamicPngStack::Dimensions)
@@ -212,46 +516,39 @@ NAN_METHOD(DynamicPngStack::PngEncodeSync)
     NanScope();
 
     DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
-    NanReturnValue(png_stack->PngEncodeSync());
-}
-
-void DynamicPngStack::DynamicPngEncodeWorker::Execute() {
-    std::pair<Point, Point> optimal = png_obj->optimal_dimension();
-    Point top = optimal.first, bot = optimal.second;
-
-    png_obj->offset = top;
-    png_obj->width = bot.x - top.x;
-    png_obj->height = bot.y - top.y;
-
-    unsigned char *data = (unsigned char*)malloc(sizeof(*data) * png_obj->width * png_obj->height * 4);
-    if (!data) {
-        errmsg = strdup("malloc failed in DynamicPngStack::UV_PngEncode.");
-        return;
+    if (png_stack->disposed)
+        return NanThrowError("DynamicPngStack has been disposed.");
+
+    EncodeOptions opts = png_stack->opts;
+    Local<Object> output;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (err)
+            return NanThrowTypeError(err);
     }
 
-    memset(data, 0xFF, png_obj->width*png_obj->height*4);
-
-    png_obj->construct_png_data(data, top);
-
-    buffer_type pbt = (png_obj->buf_type == BUF_BGR || png_obj->buf_type == BUF_BGRA) ?
-        BUF_BGRA : BUF_RGBA;
+    NanReturnValue(png_stack->PngEncodeSync(opts, output));
+}
 
+void DynamicPngStack::DynamicPngEncodeWorker::Execute() {
+    uint64_t start = uv_hrtime();
+    unsigned char *data = NULL;
+    StackRows rows(png_obj, snap);
     try {
-        PngEncoder encoder(data, png_obj->width, png_obj->height, pbt);
-        encoder.encode();
+        data = png_obj->compose_canvas(snap, opts);
+        if (data)
+            stats.compose_ns = uv_hrtime() - start;
+
+        PngEncoder encoder(data, snap.width, snap.height, png_obj->canvas_type, opts);
+        if (!data)
+            encoder.set_row_source(&rows);
+        encode(encoder);
         free(data);
-        png_len = encoder.get_png_len();
-        png = (char *)malloc(sizeof(*png)*png_len);
-        if (!png) {
-            errmsg = strdup("malloc in DynamicPngStack::DynamicPngEncodeWorker::Execute() failed.");
-            return;
-        }
-        else {
-            memcpy(png, encoder.get_png(), png_len);
-        }
     }
     catch (const char *err) {
-        if (data) free(data);
+        free(data);
         errmsg = strdup(err);
     }
 }
@@ -259,26 +556,29 @@ void DynamicPngStack::DynamicPngEncodeWorker::Execute() {
 void DynamicPngStack::DynamicPngEncodeWorker::HandleOKCallback() {
     NanScope();
 
-    Local<Object> buf = NanNewBufferHandle(png_len);
-    memcpy(Buffer::Data(buf), png, png_len);
-    Local<Value> argv[3] = {buf, png_obj->Dimensions(), Undefined()};
+    Local<Value> buf = png_result();
+    png_obj->last_stats = stats;
+    png_obj->offset = snap.top;
+    png_obj->width = snap.width;
+    png_obj->height = snap.height;
+    Local<Value> argv[4] = {buf, png_obj->Dimensions(), Undefined(), stats_object(stats)};
 
     TryCatch try_catch; // don't quite see the necessity of this
 
-    callback->Call(3, argv);
+    callback->Call(4, argv);
 
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
-    free(png);
-    png = NULL;
-
+    png_obj->encode_done();
     png_obj->Unref();
 }
 
 void DynamicPngStack::DynamicPngEncodeWorker::HandleErrorCallback() {
     NanScope();
 
+    record_failed_encode();
+
     Local<Value> argv[3] = {Undefined(), Undefined(), Exception::Error(String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -293,6 +593,7 @@ void DynamicPngStack::DynamicPngEncodeWorker::HandleErrorCallback() {
         png = NULL;
     }
 
+    png_obj->encode_done();
     png_obj->Unref();
 }
 
@@ -300,19 +601,71 @@ NAN_METHOD(DynamicPngStack::PngEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("Callback function required, optionally preceded by options.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
 
-    if (!args[0]->IsFunction())
-        return NanThrowTypeError("First argument must be a function.");
+    if (EncoderPool::full())
+        return NanThrowError("Too many encodes pending, see setMaxPendingEncodes.");
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     DynamicPngStack *png = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    if (png->disposed)
+        return NanThrowError("DynamicPngStack has been disposed.");
+
+    EncodeOptions opts = png->opts;
+    Local<Object> output;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (err)
+            return NanThrowTypeError(err);
+    }
 
-    NanAsyncQueueWorker(new DynamicPngStack::DynamicPngEncodeWorker(new NanCallback(callback), png));
+    DynamicPngStack::DynamicPngEncodeWorker *worker = new DynamicPngStack::DynamicPngEncodeWorker(new NanCallback(callback), png, opts);
+    if (!output.IsEmpty())
+        worker->set_output(output);
+    unsigned int id = EncoderPool::queue_worker(worker);
 
+    png->encoding++;
     png->Ref();
 
+    NanReturnValue(Integer::NewFromUnsigned(id));
+}
+
+NAN_METHOD(DynamicPngStack::Stats)
+{
+    NanScope();
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    NanReturnValue(stats_object(png_stack->last_stats));
+}
+
+NAN_METHOD(DynamicPngStack::Reset)
+{
+    NanScope();
+
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    if (png_stack->disposed)
+        return NanThrowError("DynamicPngStack has been disposed.");
+    if (png_stack->encoding)
+        return NanThrowError("Can't reset while an encode is running.");
+
+    png_stack->free_pngs();
+
     NanReturnUndefined();
 }
 
+NAN_METHOD(DynamicPngStack::Dispose)
+{
+    NanScope();
+
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    png_stack->disposed = true;
+    if (!png_stack->encoding)
+        png_stack->free_pngs();
+
+    NanReturnUndefined();
+}
@@ -4,6 +4,7 @@
 #include <node.h>
 #include <node_buffer.h>
 
+#include <map>
 #include <utility>
 #include <vector>
 
@@ -12,42 +13,96 @@
 #include "common.h"
 
 class DynamicPngStack : public node::ObjectWrap {
+    // A pushed buffer: either a copy, or the caller's Buffer itself, held
+    // by a persistent handle until the Png is deleted on the main thread.
     struct Png {
         int len, x, y, w, h;
+        blend_mode blend;
         unsigned char *data;
+        v8::Persistent<v8::Object> buffer;
 
-        Png(unsigned char *ddata, int llen, int xx, int yy, int ww, int hh) :
-            len(llen), x(xx), y(yy), w(ww), h(hh)
+        Png(unsigned char *ddata, int llen, blend_mode bblend, int xx, int yy, int ww, int hh) :
+            len(llen), x(xx), y(yy), w(ww), h(hh), blend(bblend)
         {
             data = (unsigned char *)malloc(sizeof(*data)*len);
             if (!data) throw "malloc failed in DynamicPngStack::Png::Png";
             memcpy(data, ddata, len);
         }
 
+        Png(v8::Handle<v8::Object> buf, blend_mode bblend, int xx, int yy, int ww, int hh) :
+            len(node::Buffer::Length(buf)), x(xx), y(yy), w(ww), h(hh), blend(bblend),
+            data((unsigned char *)node::Buffer::Data(buf)),
+            buffer(v8::Persistent<v8::Object>::New(buf)) {}
+
         ~Png() {
-            free(data);
+            if (buffer.IsEmpty()) {
+                free(data);
+            }
+            else {
+                buffer.Dispose();
+                buffer.Clear();
+            }
         }
     };
 
     typedef std::vector<Png *> vPng;
     typedef vPng::iterator vPngi;
-    vPng png_stack;
-    Point offset;
+    vPng png_stack;           // NULL where drop_covered() deleted a push
+
+    // Indexes into png_stack, in push order, by the buckets of BUCKET_ROWS
+    // rows each push covers, so that a band of rows only looks at the
+    // pushes that overlap it. The bounding box of all pushes is kept up to
+    // date as they come in too.
+    typedef std::map<int, std::vector<int> > RowIndex;
+    RowIndex row_index;
+    Point bbox_top, bbox_bot;
+
+    void index_png(int i);
+    void pngs_in_rows(const vPng &pngs, int y, int nrows, std::vector<int> &found);
+
+    // What an encode composes: the area the pushes cover and the pushes,
+    // as they were when the encode started. An async encode reads only its
+    // snapshot, and push() throws until it's done, so that row_index
+    // doesn't change under it either.
+    struct Snapshot {
+        Point top;
+        int width, height;
+        vPng pngs;
+    };
+    Snapshot snapshot();
+
+    Point offset;             // area of the latest encode, for dimensions()
     int width, height;
-    buffer_type buf_type;
+    buffer_type buf_type;     // layout of pushed buffers
+    buffer_type canvas_type;  // layout of the composed image
+    EncodeOptions opts;
+    EncodeStats last_stats;
+    size_t pushed_bytes;      // copies of pushed buffers, reported to V8
+    bool copy_pushes;         // default of push's copy option
+    blend_mode blend;         // default of push's blend option
+    bool disposed;
+    int encoding;             // async encodes reading png_stack
+
+    void free_pngs();
+    void encode_done();
 
     std::pair<Point, Point> optimal_dimension();
 
-    void construct_png_data(unsigned char *data, Point &top);
+    void drop_covered(const Png *png);
+    void compose_rows(const Snapshot &snap, unsigned char *rows, int y, int nrows);
+    unsigned char *compose_canvas(const Snapshot &snap, const EncodeOptions &eopts);
+
+    friend class StackRows;
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    DynamicPngStack(buffer_type bbuf_type);
+    DynamicPngStack(buffer_type bbuf_type, buffer_type ccanvas_type, const EncodeOptions &oopts,
+        bool ccopy_pushes, blend_mode bblend);
     ~DynamicPngStack();
 
     class DynamicPngEncodeWorker : public PngEncoder::EncodeWorker {
     public:
-        DynamicPngEncodeWorker(NanCallback *callback, DynamicPngStack *png) : PngEncoder::EncodeWorker(callback), png_obj(png) {
+        DynamicPngEncodeWorker(NanCallback *callback, DynamicPngStack *png, const EncodeOptions &opts) : PngEncoder::EncodeWorker(callback, opts), png_obj(png), snap(png->snapshot()) {
         };
 
         void Execute();
@@ -56,17 +111,22 @@ public:
 
     private:
         DynamicPngStack *png_obj;
+        Snapshot snap;
     };
 
-    v8::Handle<v8::Value> Push(unsigned char *buf_data, size_t buf_len, int x, int y, int w, int h);
+    v8::Handle<v8::Value> Push(v8::Handle<v8::Object> buf, bool copy, blend_mode push_blend,
+        int x, int y, int w, int h);
     v8::Handle<v8::Value> Dimensions();
-    v8::Handle<v8::Value> PngEncodeSync();
+    v8::Handle<v8::Value> PngEncodeSync(const EncodeOptions &eopts, v8::Handle<v8::Object> output);
 
     static NAN_METHOD(New);
     static NAN_METHOD(Push);
     static NAN_METHOD(Dimensions);
     static NAN_METHOD(PngEncodeSync);
     static NAN_METHOD(PngEncodeAsync);
+    static NAN_METHOD(Stats);
+    static NAN_METHOD(Reset);
+    static NAN_METHOD(Dispose);
 };
 
 #endif
@@ -0,0 +1,251 @@
+#include <png.h>
+#include <zlib.h>
+
+#include <node_buffer.h>
+
+#include "encode_options.h"
+#include "compressor.h"
+
+using namespace v8;
+
+static int
+filter_flag(const char *name)
+{
+    if (str_eq(name, "none"))
+        return PNG_FILTER_NONE;
+    if (str_eq(name, "sub"))
+        return PNG_FILTER_SUB;
+    if (str_eq(name, "up"))
+        return PNG_FILTER_UP;
+    if (str_eq(name, "avg") || str_eq(name, "average"))
+        return PNG_FILTER_AVG;
+    if (str_eq(name, "paeth"))
+        return PNG_FILTER_PAETH;
+    if (str_eq(name, "all"))
+        return PNG_ALL_FILTERS;
+    return 0;
+}
+
+static const char *
+parse_filters(Handle<Value> val, int &filters)
+{
+    static const char *err = "Option filters must be 'none', 'sub', 'up', 'avg', 'paeth', 'all' or an array of those.";
+
+    if (val->IsString()) {
+        String::AsciiValue fs(val->ToString());
+        filters = filter_flag(*fs);
+        return filters ? NULL : err;
+    }
+    if (!val->IsArray())
+        return err;
+
+    Handle<Array> arr = Handle<Array>::Cast(val);
+    if (arr->Length() == 0)
+        return err;
+
+    int mask = 0;
+    for (uint32_t i = 0; i < arr->Length(); i++) {
+        Local<Value> el = arr->Get(i);
+        if (!el->IsString())
+            return err;
+        String::AsciiValue fs(el->ToString());
+        int flag = filter_flag(*fs);
+        if (!flag)
+            return err;
+        mask |= flag;
+    }
+    filters = mask;
+    return NULL;
+}
+
+const char *
+parse_encode_options(Handle<Value> val, EncodeOptions &opts)
+{
+    if (val->IsUndefined())
+        return NULL;
+    if (!val->IsObject())
+        return "Options must be an object.";
+
+    Local<Object> obj = val->ToObject();
+
+    if (obj->Has(String::NewSymbol("level"))) {
+        Local<Value> level = obj->Get(String::NewSymbol("level"));
+        if (!level->IsInt32() || level->Int32Value() < 0 || level->Int32Value() > 9)
+            return "Option level must be an integer between 0 and 9.";
+        opts.level = level->Int32Value();
+    }
+
+    if (obj->Has(String::NewSymbol("strategy"))) {
+        Local<Value> strategy = obj->Get(String::NewSymbol("strategy"));
+        if (!strategy->IsString())
+            return "Option strategy must be 'default', 'filtered', 'huffman', 'rle' or 'fixed'.";
+
+        String::AsciiValue ss(strategy->ToString());
+        if (str_eq(*ss, "default"))
+            opts.strategy = Z_DEFAULT_STRATEGY;
+        else if (str_eq(*ss, "filtered"))
+            opts.strategy = Z_FILTERED;
+        else if (str_eq(*ss, "huffman"))
+            opts.strategy = Z_HUFFMAN_ONLY;
+        else if (str_eq(*ss, "rle"))
+            opts.strategy = Z_RLE;
+        else if (str_eq(*ss, "fixed"))
+            opts.strategy = Z_FIXED;
+        else
+            return "Option strategy must be 'default', 'filtered', 'huffman', 'rle' or 'fixed'.";
+    }
+
+    if (obj->Has(String::NewSymbol("filters"))) {
+        const char *err = parse_filters(obj->Get(String::NewSymbol("filters")), opts.filters);
+        if (err)
+            return err;
+    }
+
+    if (obj->Has(String::NewSymbol("threads"))) {
+        Local<Value> threads = obj->Get(String::NewSymbol("threads"));
+        if (!threads->IsInt32() || threads->Int32Value() < 0)
+            return "Option threads must be a non-negative integer.";
+        opts.threads = threads->Int32Value();
+    }
+
+    if (obj->Has(String::NewSymbol("stream")))
+        opts.stream = obj->Get(String::NewSymbol("stream"))->BooleanValue();
+
+    if (obj->Has(String::NewSymbol("chunkSize"))) {
+        Local<Value> chunk_size = obj->Get(String::NewSymbol("chunkSize"));
+        if (!chunk_size->IsInt32() || chunk_size->Int32Value() < 1)
+            return "Option chunkSize must be a positive integer.";
+        opts.chunk_size = chunk_size->Int32Value();
+    }
+
+    if (obj->Has(String::NewSymbol("reuseContext")))
+        opts.reuse_context = obj->Get(String::NewSymbol("reuseContext"))->BooleanValue();
+
+    if (obj->Has(String::NewSymbol("backend"))) {
+        Local<Value> backend = obj->Get(String::NewSymbol("backend"));
+        if (!backend->IsString())
+            return "Option backend must be 'zlib', 'zlib-ng' or 'libdeflate'.";
+
+        String::AsciiValue bs(backend->ToString());
+        if (str_eq(*bs, "zlib"))
+            opts.backend = BACKEND_ZLIB;
+        else if (str_eq(*bs, "zlib-ng"))
+            opts.backend = BACKEND_ZLIB_NG;
+        else if (str_eq(*bs, "libdeflate"))
+            opts.backend = BACKEND_LIBDEFLATE;
+        else
+            return "Option backend must be 'zlib', 'zlib-ng' or 'libdeflate'.";
+
+        if (!Compressor::available(opts.backend))
+            return "node-png was built without this compression backend.";
+    }
+
+    if (obj->Has(String::NewSymbol("palette")))
+        opts.palette = obj->Get(String::NewSymbol("palette"))->BooleanValue();
+
+    if (obj->Has(String::NewSymbol("colors"))) {
+        Local<Value> colors = obj->Get(String::NewSymbol("colors"));
+        if (!colors->IsInt32() || colors->Int32Value() < 2 || colors->Int32Value() > 256)
+            return "Option colors must be an integer between 2 and 256.";
+        opts.colors = colors->Int32Value();
+    }
+
+    if (obj->Has(String::NewSymbol("dither")))
+        opts.dither = obj->Get(String::NewSymbol("dither"))->BooleanValue();
+
+    if (obj->Has(String::NewSymbol("reduce")))
+        opts.reduce = obj->Get(String::NewSymbol("reduce"))->BooleanValue();
+
+    return NULL;
+}
+
+const char *
+parse_canvas_option(Handle<Value> val, buffer_type buf_type, buffer_type &canvas_type)
+{
+    canvas_type = with_alpha(buf_type);
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    if (!obj->Has(String::NewSymbol("canvas")))
+        return NULL;
+
+    Local<Value> canvas = obj->Get(String::NewSymbol("canvas"));
+    if (!canvas->IsString())
+        return "Option canvas must be 'alpha' or 'native'.";
+
+    String::AsciiValue cs(canvas->ToString());
+    if (str_eq(*cs, "native"))
+        canvas_type = buf_type;
+    else if (!str_eq(*cs, "alpha"))
+        return "Option canvas must be 'alpha' or 'native'.";
+    return NULL;
+}
+
+const char *
+parse_output_option(Handle<Value> val, Local<Object> &output)
+{
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    if (!obj->Has(String::NewSymbol("output")))
+        return NULL;
+
+    Local<Value> out = obj->Get(String::NewSymbol("output"));
+    if (!node::Buffer::HasInstance(out))
+        return "Option output must be a Buffer.";
+    output = out->ToObject();
+    return NULL;
+}
+
+const char *
+parse_pin_option(Handle<Value> val, pin_mode &pin)
+{
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    if (!obj->Has(String::NewSymbol("pin")))
+        return NULL;
+
+    Local<Value> p = obj->Get(String::NewSymbol("pin"));
+    if (!p->IsString())
+        return "Option pin must be 'none', 'check' or 'copy'.";
+    String::AsciiValue name(p->ToString());
+    if (str_eq(*name, "none"))
+        pin = PIN_NONE;
+    else if (str_eq(*name, "check"))
+        pin = PIN_CHECK;
+    else if (str_eq(*name, "copy"))
+        pin = PIN_COPY;
+    else
+        return "Option pin must be 'none', 'check' or 'copy'.";
+    return NULL;
+}
+
+const char *
+parse_blend_option(Handle<Value> val, blend_mode &blend)
+{
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    if (!obj->Has(String::NewSymbol("blend")))
+        return NULL;
+
+    Local<Value> b = obj->Get(String::NewSymbol("blend"));
+    if (!b->IsString())
+        return "Option blend must be 'none', 'over' or 'over-premultiplied'.";
+    String::AsciiValue name(b->ToString());
+    if (str_eq(*name, "none"))
+        blend = BLEND_NONE;
+    else if (str_eq(*name, "over"))
+        blend = BLEND_OVER;
+    else if (str_eq(*name, "over-premultiplied"))
+        blend = BLEND_OVER_PREMULTIPLIED;
+    else
+        return "Option blend must be 'none', 'over' or 'over-premultiplied'.";
+    return NULL;
+}
+
@@ -0,0 +1,84 @@
+#ifndef ENCODE_OPTIONS_H
+#define ENCODE_OPTIONS_H
+
+#include <node.h>
+
+#include "common.h"
+
+typedef enum { BACKEND_ZLIB, BACKEND_ZLIB_NG, BACKEND_LIBDEFLATE } compress_backend;
+
+struct EncodeOptions {
+    int level;      // zlib compression level 0-9, -1 leaves libpng's default
+    int strategy;   // zlib strategy (Z_FILTERED, Z_RLE, ...), -1 leaves libpng's default
+    int filters;    // mask of PNG_FILTER_* flags, 0 leaves libpng's default
+    int threads;    // row strips deflated in parallel, 0 for one per core
+    bool stream;    // pass the PNG to the callback in pieces as it's produced
+    int chunk_size; // size of the streamed pieces
+    bool reuse_context; // take libpng's memory from the per-thread pool
+    compress_backend backend; // deflate implementation
+    bool palette;   // write an indexed PNG
+    int colors;     // most colors the palette may have
+    bool dither;    // dither when the image has more colors than that
+    bool reduce;    // write the smallest lossless PNG format for the image
+
+    // Set by async encodes, which can be cancelled while they run: the
+    // encode gives up at the next batch of rows once *cancel is true.
+    const volatile bool *cancel;
+
+    EncodeOptions() : level(-1), strategy(-1), filters(0), threads(1),
+        stream(false), chunk_size(16*1024), reuse_context(true),
+        backend(BACKEND_ZLIB), palette(false), colors(256), dither(false),
+        reduce(false), cancel(NULL) {}
+};
+
+// Rows encoded between two looks at the cancel flag.
+static const int CANCEL_CHECK_ROWS = 64;
+
+inline bool
+cancelled(const EncodeOptions &opts)
+{
+    return opts.cancel && *opts.cancel;
+}
+
+// Throws if the encode has been cancelled.
+inline void
+check_cancelled(const EncodeOptions &opts)
+{
+    if (cancelled(opts))
+        throw "Encode cancelled.";
+}
+
+// How an async encode guards against the caller changing its Buffer while
+// the encode reads it: not at all, by failing if a checksum of the Buffer
+// taken before the encode doesn't match one taken after it, or by encoding
+// a copy taken when the encode was queued.
+typedef enum { PIN_NONE, PIN_CHECK, PIN_COPY } pin_mode;
+
+// How a stack puts a pushed buffer on what's under it: replacing it, or
+// compositing it over it (Porter-Duff source-over) with the buffer's alpha
+// taken as straight or as premultiplied into the colors.
+typedef enum { BLEND_NONE, BLEND_OVER, BLEND_OVER_PREMULTIPLIED } blend_mode;
+
+// Reads the properties of an options object into opts, leaving the fields
+// whose property is absent untouched, so defaults given to a constructor can
+// be overridden per encode. Returns NULL on success or an error message.
+const char *parse_encode_options(v8::Handle<v8::Value> val, EncodeOptions &opts);
+
+// Stores the Buffer given as the output option, if any, in output.
+const char *parse_output_option(v8::Handle<v8::Value> val, v8::Local<v8::Object> &output);
+
+// Reads the pin option ('none', 'check' or 'copy') into pin, if present.
+const char *parse_pin_option(v8::Handle<v8::Value> val, pin_mode &pin);
+
+// Reads the blend option ('none', 'over' or 'over-premultiplied') into
+// blend, if present.
+const char *parse_blend_option(v8::Handle<v8::Value> val, blend_mode &blend);
+
+// Picks the layout of a stack's canvas for pushed buffers of buf_type from
+// the canvas option: 'alpha' (the default) adds an alpha channel so that
+// uncovered areas are transparent, 'native' keeps buf_type.
+const char *parse_canvas_option(v8::Handle<v8::Value> val, buffer_type buf_type,
+    buffer_type &canvas_type);
+
+#endif
+
@@ -0,0 +1,86 @@
+#include "encode_stats.h"
+
+using namespace v8;
+
+static EncodeStats totals;
+static double encodes, failures;
+
+void
+EncodeStats::add(const EncodeStats &other)
+{
+    queue_ns += other.queue_ns;
+    compose_ns += other.compose_ns;
+    convert_ns += other.convert_ns;
+    compress_ns += other.compress_ns;
+    output_ns += other.output_ns;
+    total_ns += other.total_ns;
+    in_bytes += other.in_bytes;
+    out_bytes += other.out_bytes;
+}
+
+void
+record_encode(const EncodeStats &stats)
+{
+    totals.add(stats);
+    encodes++;
+}
+
+void
+record_failed_encode()
+{
+    failures++;
+}
+
+static void
+set_stats(Local<Object> obj, const EncodeStats &stats)
+{
+    obj->Set(String::NewSymbol("queueWait"), Number::New(stats.queue_ns / 1e6));
+    obj->Set(String::NewSymbol("compose"), Number::New(stats.compose_ns / 1e6));
+    obj->Set(String::NewSymbol("convert"), Number::New(stats.convert_ns / 1e6));
+    obj->Set(String::NewSymbol("compress"), Number::New(stats.compress_ns / 1e6));
+    obj->Set(String::NewSymbol("output"), Number::New(stats.output_ns / 1e6));
+    obj->Set(String::NewSymbol("total"), Number::New(stats.total_ns / 1e6));
+    obj->Set(String::NewSymbol("inBytes"), Number::New((double)stats.in_bytes));
+    obj->Set(String::NewSymbol("outBytes"), Number::New((double)stats.out_bytes));
+}
+
+Local<Object>
+stats_object(const EncodeStats &stats)
+{
+    NanScope();
+
+    Local<Object> obj = Object::New();
+    set_stats(obj, stats);
+    return scope.Close(obj);
+}
+
+void
+InitializeEncodeStats(Handle<Object> target)
+{
+    NanScope();
+
+    NODE_SET_METHOD(target, "encoderStats", EncoderStats);
+    NODE_SET_METHOD(target, "resetEncoderStats", ResetEncoderStats);
+}
+
+NAN_METHOD(EncoderStats)
+{
+    NanScope();
+
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("encodes"), Number::New(encodes));
+    obj->Set(String::NewSymbol("failures"), Number::New(failures));
+    set_stats(obj, totals);
+
+    NanReturnValue(obj);
+}
+
+NAN_METHOD(ResetEncoderStats)
+{
+    NanScope();
+
+    totals = EncodeStats();
+    encodes = failures = 0;
+
+    NanReturnUndefined();
+}
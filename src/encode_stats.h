@@ -0,0 +1,39 @@
+#ifndef ENCODE_STATS_H
+#define ENCODE_STATS_H
+
+#include <node.h>
+
+#include "nan.h"
+
+// Where the time of an encode went, in nanoseconds of uv_hrtime(), and how
+// many bytes went in and out. Stages that didn't happen stay 0.
+struct EncodeStats {
+    uint64_t queue_ns;    // waiting for an encoder thread
+    uint64_t compose_ns;  // building a stack's canvas
+    uint64_t convert_ns;  // quantizing or reducing the image
+    uint64_t compress_ns; // filtering, deflating and writing the PNG
+    uint64_t output_ns;   // handing the PNG over to JavaScript
+    uint64_t total_ns;    // from the encode call to the result
+    uint64_t in_bytes;    // pixel data encoded
+    uint64_t out_bytes;   // PNG bytes produced
+
+    EncodeStats() : queue_ns(0), compose_ns(0), convert_ns(0), compress_ns(0),
+        output_ns(0), total_ns(0), in_bytes(0), out_bytes(0) {}
+
+    void add(const EncodeStats &other);
+};
+
+// Adds an encode to the process-wide totals. Main thread only.
+void record_encode(const EncodeStats &stats);
+void record_failed_encode();
+
+// The stats as an object with times in milliseconds.
+v8::Local<v8::Object> stats_object(const EncodeStats &stats);
+
+void InitializeEncodeStats(v8::Handle<v8::Object> target);
+
+NAN_METHOD(EncoderStats);
+NAN_METHOD(ResetEncoderStats);
+
+#endif
+
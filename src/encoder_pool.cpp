@@ -0,0 +1,457 @@
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "common.h"
+#include "encoder_pool.h"
+
+using namespace v8;
+
+struct TaskGroup {
+    int pending;
+    uv_mutex_t lock;
+    uv_cond_t done;
+};
+
+struct QueuedTask {
+    PoolTask *task;
+    TaskGroup *group;
+};
+
+struct TaskQueue {
+    uv_mutex_t lock;
+    std::deque<QueuedTask> tasks;
+};
+
+// queues[0] takes the tasks of threads outside the pool, queues[i] those
+// of pool thread i.
+static std::vector<TaskQueue *> queues;
+static int pool_size;
+static bool started;
+static uv_once_t start_once = UV_ONCE_INIT;
+
+// Idle threads sleep on idle_cond until there are tasks queued.
+static uv_mutex_t idle_lock;
+static uv_cond_t idle_cond;
+static int queued;
+
+static THREAD_LOCAL int own_queue;
+
+// Workers whose Execute() has finished, for the main thread to complete.
+static uv_async_t done_async;
+static uv_mutex_t done_lock;
+static std::vector<PoolWorker *> done_workers;
+
+// Workers that haven't completed yet, by id. Main thread only.
+static std::map<unsigned int, PoolWorker *> pending_workers;
+static unsigned int last_id;
+static int max_pending;
+
+// The task is queued with idle_lock held, so that queued counts it before
+// a thread that takes it can count it down.
+static void
+push_task(int q, const QueuedTask &qt)
+{
+    uv_mutex_lock(&idle_lock);
+    uv_mutex_lock(&queues[q]->lock);
+    queues[q]->tasks.push_back(qt);
+    uv_mutex_unlock(&queues[q]->lock);
+    queued++;
+    uv_cond_signal(&idle_cond);
+    uv_mutex_unlock(&idle_lock);
+}
+
+// A thread takes the newest task of its own queue, as its data is the most
+// likely to still be in cache, and the oldest one of any other queue, which
+// is usually the biggest piece of work left there.
+static bool
+take_from(int q, bool newest, QueuedTask &qt)
+{
+    TaskQueue *queue = queues[q];
+    uv_mutex_lock(&queue->lock);
+    bool found = !queue->tasks.empty();
+    if (found) {
+        if (newest) {
+            qt = queue->tasks.back();
+            queue->tasks.pop_back();
+        }
+        else {
+            qt = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+    }
+    uv_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// A thread waiting for a group only helps with the group's tasks: anything
+// else, such as a whole unrelated encode, could keep it busy long after the
+// group is done, and the main thread must never run someone else's encode.
+static bool
+take_group_task(int q, TaskGroup *group, QueuedTask &qt)
+{
+    TaskQueue *queue = queues[q];
+    bool found = false;
+    uv_mutex_lock(&queue->lock);
+    for (std::deque<QueuedTask>::iterator it = queue->tasks.begin(); it != queue->tasks.end(); ++it) {
+        if (it->group == group) {
+            qt = *it;
+            queue->tasks.erase(it);
+            found = true;
+            break;
+        }
+    }
+    uv_mutex_unlock(&queue->lock);
+    return found;
+}
+
+static bool
+take_task(TaskGroup *group, QueuedTask &qt)
+{
+    int self = own_queue, n = queues.size();
+    bool found;
+    if (group) {
+        found = take_group_task(self, group, qt);
+        for (int i = 1; i < n && !found; i++)
+            found = take_group_task((self + i) % n, group, qt);
+    }
+    else {
+        found = take_from(self, true, qt);
+        for (int i = 1; i < n && !found; i++)
+            found = take_from((self + i) % n, false, qt);
+    }
+    if (found) {
+        uv_mutex_lock(&idle_lock);
+        queued--;
+        uv_mutex_unlock(&idle_lock);
+    }
+    return found;
+}
+
+static void
+run_task(const QueuedTask &qt)
+{
+    qt.task->run();
+    if (qt.group) {
+        uv_mutex_lock(&qt.group->lock);
+        if (--qt.group->pending == 0)
+            uv_cond_broadcast(&qt.group->done);
+        uv_mutex_unlock(&qt.group->lock);
+    }
+}
+
+static void
+pool_thread(void *arg)
+{
+    own_queue = (int)(size_t)arg;
+    for (;;) {
+        QueuedTask qt;
+        if (take_task(NULL, qt)) {
+            run_task(qt);
+            continue;
+        }
+        uv_mutex_lock(&idle_lock);
+        while (queued == 0)
+            uv_cond_wait(&idle_cond, &idle_lock);
+        uv_mutex_unlock(&idle_lock);
+    }
+}
+
+static void
+start_pool()
+{
+    if (pool_size <= 0)
+        pool_size = cpu_count();
+
+    uv_mutex_init(&idle_lock);
+    uv_cond_init(&idle_cond);
+    for (int i = 0; i <= pool_size; i++) {
+        TaskQueue *queue = new TaskQueue;
+        uv_mutex_init(&queue->lock);
+        queues.push_back(queue);
+    }
+
+    // The threads live as long as the process. If not all of them can be
+    // created, the pool makes do with those that were.
+    int created = 0;
+    for (int i = 1; i <= pool_size; i++) {
+        uv_thread_t tid;
+        if (uv_thread_create(&tid, pool_thread, (void *)(size_t)i) != 0)
+            break;
+        created++;
+    }
+    pool_size = created;
+    started = true;
+}
+
+const char *
+EncoderPool::set_size(int nthreads)
+{
+    if (started)
+        return "The encoder pool has already started.";
+    pool_size = nthreads;
+    return NULL;
+}
+
+int
+EncoderPool::size()
+{
+    return pool_size > 0 ? pool_size : cpu_count();
+}
+
+void
+EncoderPool::run_all(PoolTask **tasks, int ntasks)
+{
+    if (ntasks <= 0)
+        return;
+    if (ntasks == 1) {
+        tasks[0]->run();
+        return;
+    }
+    uv_once(&start_once, start_pool);
+
+    TaskGroup group;
+    group.pending = ntasks - 1;
+    uv_mutex_init(&group.lock);
+    uv_cond_init(&group.done);
+
+    for (int i = 1; i < ntasks; i++) {
+        QueuedTask qt = { tasks[i], &group };
+        push_task(own_queue, qt);
+    }
+    tasks[0]->run();
+
+    // Help out until the last of the group's tasks has been taken, then wait
+    // for the threads still running them.
+    for (;;) {
+        uv_mutex_lock(&group.lock);
+        bool done = group.pending == 0;
+        uv_mutex_unlock(&group.lock);
+        if (done)
+            break;
+
+        QueuedTask qt;
+        if (take_task(&group, qt)) {
+            run_task(qt);
+            continue;
+        }
+        uv_mutex_lock(&group.lock);
+        while (group.pending > 0)
+            uv_cond_wait(&group.done, &group.lock);
+        uv_mutex_unlock(&group.lock);
+    }
+
+    uv_cond_destroy(&group.done);
+    uv_mutex_destroy(&group.lock);
+}
+
+void
+PoolWorker::set_error(const char *message)
+{
+    free(errmsg);
+    errmsg = strdup(message);
+}
+
+static const char *CANCELLED = "Encode cancelled.";
+
+static void
+worker_done(PoolWorker *worker)
+{
+    uv_mutex_lock(&done_lock);
+    done_workers.push_back(worker);
+    uv_mutex_unlock(&done_lock);
+    uv_async_send(&done_async);
+}
+
+class WorkerTask : public PoolTask {
+public:
+    PoolWorker *worker;
+
+    WorkerTask(PoolWorker *wworker) : worker(wworker) {}
+
+    void run() {
+        worker->started_at = uv_hrtime();
+        if (worker->is_cancelled())
+            worker->set_error(CANCELLED);
+        else
+            worker->Execute();
+        worker_done(worker);
+        delete this;
+    }
+};
+
+// uv_async_send may fold several sends into one call, so this completes
+// every worker that's done.
+static void
+done_cb(uv_async_t *handle, int status)
+{
+    std::vector<PoolWorker *> workers;
+    uv_mutex_lock(&done_lock);
+    workers.swap(done_workers);
+    uv_mutex_unlock(&done_lock);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        pending_workers.erase(workers[i]->id);
+        workers[i]->WorkComplete();
+        delete workers[i];
+    }
+
+    // The loop only has to stay alive while encodes are running.
+    if (pending_workers.empty() && !workers.empty())
+        uv_unref((uv_handle_t *)&done_async);
+}
+
+// If no pool thread could be created, workers run on libuv's pool instead.
+// They still finish through done_cb, so they count towards pending() and
+// their callbacks come the same way. The request is separate from the
+// worker, which done_cb may delete before libuv is done with the request.
+static void
+libuv_work_cb(uv_work_t *req)
+{
+    ((WorkerTask *)req->data)->run();
+}
+
+static void
+libuv_after_work_cb(uv_work_t *req, int status)
+{
+    delete req;
+}
+
+unsigned int
+EncoderPool::queue_worker(PoolWorker *worker)
+{
+    uv_once(&start_once, start_pool);
+
+    if (pending_workers.empty())
+        uv_ref((uv_handle_t *)&done_async);
+
+    // 0 is never a valid id.
+    if (++last_id == 0)
+        ++last_id;
+    worker->id = last_id;
+    worker->queued_at = uv_hrtime();
+    pending_workers[worker->id] = worker;
+
+    WorkerTask *task = new WorkerTask(worker);
+    if (pool_size == 0) {
+        uv_work_t *req = new uv_work_t;
+        req->data = task;
+        uv_queue_work(uv_default_loop(), req, libuv_work_cb, libuv_after_work_cb);
+        return worker->id;
+    }
+    QueuedTask qt = { task, NULL };
+    push_task(0, qt);
+    return worker->id;
+}
+
+bool
+EncoderPool::cancel(unsigned int id)
+{
+    std::map<unsigned int, PoolWorker *>::iterator found = pending_workers.find(id);
+    if (found == pending_workers.end())
+        return false;
+    PoolWorker *worker = found->second;
+    worker->cancel();
+
+    // Workers are only ever queued on queues[0], and only pool threads take
+    // them from there.
+    WorkerTask *task = NULL;
+    TaskQueue *queue = queues[0];
+    uv_mutex_lock(&queue->lock);
+    for (std::deque<QueuedTask>::iterator it = queue->tasks.begin(); it != queue->tasks.end(); ++it) {
+        if (!it->group && ((WorkerTask *)it->task)->worker == worker) {
+            task = (WorkerTask *)it->task;
+            queue->tasks.erase(it);
+            break;
+        }
+    }
+    uv_mutex_unlock(&queue->lock);
+    if (!task)
+        return false;
+
+    uv_mutex_lock(&idle_lock);
+    queued--;
+    uv_mutex_unlock(&idle_lock);
+    delete task;
+
+    // The callback still comes from the event loop, as it would have.
+    worker->set_error(CANCELLED);
+    worker_done(worker);
+    return true;
+}
+
+int
+EncoderPool::pending()
+{
+    return pending_workers.size();
+}
+
+void
+EncoderPool::set_max_pending(int max)
+{
+    max_pending = max;
+}
+
+bool
+EncoderPool::full()
+{
+    return max_pending > 0 && (int)pending_workers.size() >= max_pending;
+}
+
+void
+EncoderPool::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    uv_mutex_init(&done_lock);
+    uv_async_init(uv_default_loop(), &done_async, done_cb);
+    uv_unref((uv_handle_t *)&done_async);
+
+    NODE_SET_METHOD(target, "setEncoderThreads", SetEncoderThreads);
+    NODE_SET_METHOD(target, "setMaxPendingEncodes", SetMaxPendingEncodes);
+    NODE_SET_METHOD(target, "pendingEncodes", PendingEncodes);
+    NODE_SET_METHOD(target, "cancelEncode", CancelEncode);
+}
+
+NAN_METHOD(EncoderPool::SetEncoderThreads)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsInt32() || args[0]->Int32Value() < 0)
+        return NanThrowTypeError("Argument must be a non-negative integer number of threads.");
+
+    const char *err = set_size(args[0]->Int32Value());
+    if (err)
+        return NanThrowError(err);
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(EncoderPool::SetMaxPendingEncodes)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsInt32() || args[0]->Int32Value() < 0)
+        return NanThrowTypeError("Argument must be a non-negative integer, 0 for no limit.");
+
+    set_max_pending(args[0]->Int32Value());
+
+    NanReturnUndefined();
+}
+
+NAN_METHOD(EncoderPool::PendingEncodes)
+{
+    NanScope();
+
+    NanReturnValue(Integer::New(pending()));
+}
+
+NAN_METHOD(EncoderPool::CancelEncode)
+{
+    NanScope();
+
+    if (args.Length() != 1 || !args[0]->IsUint32())
+        return NanThrowTypeError("Argument must be the value returned by encode.");
+
+    NanReturnValue(Boolean::New(cancel(args[0]->Uint32Value())));
+}
@@ -0,0 +1,83 @@
+#ifndef ENCODER_POOL_H
+#define ENCODER_POOL_H
+
+#include <node.h>
+
+#include "nan.h"
+
+// A piece of work for the encoder pool.
+class PoolTask {
+public:
+    virtual ~PoolTask() {}
+    virtual void run() = 0;
+};
+
+// An async encode run by the encoder pool. It can be cancelled until its
+// callback has been called: if it hasn't started yet it's dropped, else it
+// stops at the next batch of rows if its encoder passes cancel_flag() on
+// (see EncodeOptions::cancel). Either way it then fails with "Encode
+// cancelled.", so HandleErrorCallback() releases what it holds.
+class PoolWorker : public NanAsyncWorker {
+    volatile bool cancelled;
+
+public:
+    unsigned int id;
+    uint64_t queued_at, started_at;  // uv_hrtime(), 0 if not queued by the pool
+
+    PoolWorker(NanCallback *callback) : NanAsyncWorker(callback), cancelled(false), id(0),
+        queued_at(0), started_at(0) {}
+
+    const volatile bool *cancel_flag() const { return &cancelled; }
+    void cancel() { cancelled = true; }
+    bool is_cancelled() const { return cancelled; }
+
+    // Makes the worker fail with message, without running Execute().
+    void set_error(const char *message);
+};
+
+// The threads all encodes run on, apart from libuv's pool, so that PNG work
+// never holds up fs and dns requests. Every thread has its own task queue:
+// tasks a thread splits its work into go to its own queue, and idle threads
+// steal from the others, so the pieces of a big encode spread over all
+// cores. libuv only carries completions back to the main thread.
+class EncoderPool {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    // Sets the number of threads, which can only be done before the pool
+    // has started. 0 means one per core, the default. Returns NULL on
+    // success or an error message.
+    static const char *set_size(int nthreads);
+    static int size();
+
+    // Runs tasks on the pool and returns once all of them have finished.
+    // The calling thread runs tasks of the same call too while it waits, so
+    // this can be called from a task. Tasks must not throw.
+    static void run_all(PoolTask **tasks, int ntasks);
+
+    // Runs worker's Execute() on the pool and its callbacks on the main
+    // thread, like NanAsyncQueueWorker does on libuv's pool, which it falls
+    // back on if the pool has no threads. Returns the id to cancel it with.
+    // Main thread only, like the rest below.
+    static unsigned int queue_worker(PoolWorker *worker);
+
+    // Cancels the worker with the given id. Returns true if it was dropped
+    // before it started, false if it's already running (and has been asked
+    // to stop) or done. Workers on libuv's pool (see queue_worker()) are
+    // never dropped, but fail as cancelled when they start.
+    static bool cancel(unsigned int id);
+
+    // Workers queued or running, and the most there may be, 0 for no limit.
+    // Callers check full() before they create a worker.
+    static int pending();
+    static void set_max_pending(int max);
+    static bool full();
+
+    static NAN_METHOD(SetEncoderThreads);
+    static NAN_METHOD(SetMaxPendingEncodes);
+    static NAN_METHOD(PendingEncodes);
+    static NAN_METHOD(CancelEncode);
+};
+
+#endif
+
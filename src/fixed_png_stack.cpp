@@ -1,6 +1,8 @@
 #include <cstdlib>
 
 #include "png_encoder.h"
+#include "blend.h"
+#include "encoder_pool.h"
 #include "fixed_png_stack.h"
 
 using namespace v8;
@@ -16,53 +18,113 @@ FixedPngStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", Reset);
+    NODE_SET_PROTOTYPE_METHOD(t, "dispose", Dispose);
     target->Set(String::NewSymbol("FixedPngStack"), t->GetFunction());
 }
 
-FixedPngStack::FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), buf_type(bbuf_type)
+FixedPngStack::FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type, buffer_type ccanvas_type,
+    const EncodeOptions &oopts, blend_mode bblend, bool cache_strips) :
+    width(wwidth), height(hheight), buf_type(bbuf_type), canvas_type(ccanvas_type), opts(oopts), blend(bblend),
+    disposed(false), encoding(0), strip_cache(NULL), cache_bytes(0)
 {
-    data = (unsigned char *)malloc(sizeof(*data) * width * height * 4);
+    size_t len = (size_t)width * height * buffer_channels(canvas_type);
+    data = (unsigned char *)malloc(sizeof(*data) * len);
     if (!data) throw "malloc failed in node-png (FixedPngStack ctor)";
-    memset(data, 0xFF, width*height*4);
+    memset(data, 0xFF, len);
+
+    // So that V8 collects stacks nobody uses any more before the canvases
+    // run the process out of memory.
+    V8::AdjustAmountOfExternalAllocatedMemory(len);
+
+    if (cache_strips)
+        strip_cache = new StripCache(height, (size_t)width * buffer_channels(canvas_type));
 }
 
 FixedPngStack::~FixedPngStack()
 {
+    free_data();
+    delete strip_cache;
+}
+
+void
+FixedPngStack::free_data()
+{
+    if (!data)
+        return;
     free(data);
+    data = NULL;
+    V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t)((size_t)width * height * buffer_channels(canvas_type)));
+
+    if (strip_cache) {
+        strip_cache->clear();
+        V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t)cache_bytes);
+        cache_bytes = 0;
+    }
+}
+
+// Gives the strip cache back after an encode and tells V8 how much it holds
+// now.
+void
+FixedPngStack::release_cache(bool ok)
+{
+    strip_cache->release(ok);
+    size_t bytes = strip_cache->memory();
+    V8::AdjustAmountOfExternalAllocatedMemory((intptr_t)bytes - (intptr_t)cache_bytes);
+    cache_bytes = bytes;
 }
 
+// A disposed stack keeps its canvas until the last encode reading it is done.
 void
-FixedPngStack::Push(unsigned char *buf_data, int x, int y, int w, int h)
+FixedPngStack::encode_done()
 {
-    int start = y*width*4 + x*4;
+    if (--encoding == 0 && disposed)
+        free_data();
+}
+
+void
+FixedPngStack::Push(unsigned char *buf_data, blend_mode push_blend, int x, int y, int w, int h)
+{
+    int channels = buffer_channels(canvas_type);
+    int buf_rowbytes = w * buffer_channels(buf_type);
     for (int i = 0; i < h; i++) {
-        unsigned char *datap = &data[start + i*width*4];
-        for (int j = 0; j < w; j++) {
-            *datap++ = *buf_data++;
-            *datap++ = *buf_data++;
-            *datap++ = *buf_data++;
-            *datap++ = (buf_type == BUF_RGB || buf_type == BUF_BGR) ? 0x00 : *buf_data++;
-        }
+        unsigned char *datap = &data[((size_t)(y + i)*width + x)*channels];
+        blend_pixels(buf_data + (size_t)i*buf_rowbytes, buf_type, datap, canvas_type, w, push_blend);
     }
+    if (strip_cache)
+        strip_cache->mark_dirty(y, h);
 }
 
 Handle<Value>
-FixedPngStack::PngEncodeSync()
+FixedPngStack::PngEncodeSync(const EncodeOptions &eopts, Handle<Object> output)
 {
     NanScope();
 
-    buffer_type pbt = (buf_type == BUF_BGR || buf_type == BUF_BGRA) ? BUF_BGRA : BUF_RGBA;
-
+    bool cached = strip_cache && strip_cache->acquire(eopts);
     try {
-        PngEncoder encoder(data, width, height, pbt);
+        uint64_t start = uv_hrtime();
+        PngEncoder encoder(data, width, height, canvas_type, eopts);
+        if (!output.IsEmpty())
+            encoder.set_output(Buffer::Data(output), Buffer::Length(output));
+        if (cached)
+            encoder.set_strip_cache(strip_cache);
         encoder.encode();
-        int png_len = encoder.get_png_len();
-        Local<Object> retbuf = NanNewBufferHandle(png_len);
-        memcpy(Buffer::Data(retbuf), encoder.get_png(), png_len);
-        return scope.Close(retbuf);
+        if (cached)
+            release_cache(true);
+        uint64_t encoded = uv_hrtime();
+        Local<Object> buf = encoder.get_buffer(output);
+
+        last_stats = encoder.get_stats();
+        last_stats.output_ns = uv_hrtime() - encoded;
+        last_stats.total_ns = uv_hrtime() - start;
+        record_encode(last_stats);
+        return scope.Close(buf);
     }
     catch (const char *err) {
+        if (cached)
+            release_cache(false);
+        record_failed_encode();
         return ThrowException(Exception::Error(String::New(err)));
     }
 }
@@ -72,24 +134,18 @@ NAN_METHOD(FixedPngStack::New)
     NanScope();
 
     if (args.Length() < 2)
-        return NanThrowError("At least two arguments required - width and height [and input buffer type].");
+        return NanThrowError("At least two arguments required - width and height [input buffer type and options].");
     if (!args[0]->IsInt32())
         return NanThrowTypeError("First argument must be integer width.");
     if (!args[1]->IsInt32())
         return NanThrowTypeError("Second argument must be integer height.");
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 3) {
+    if (args.Length() >= 3 && !args[2]->IsUndefined()) {
         if (!args[2]->IsString())
-            return NanThrowTypeError("Third argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Third argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
 
         String::AsciiValue bts(args[2]->ToString());
-        if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
-                    str_eq(*bts, "rgba") || str_eq(*bts, "bgra")))
-        {
-            return NanThrowTypeError("Third argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
-        }
-
         if (str_eq(*bts, "rgb"))
             buf_type = BUF_RGB;
         else if (str_eq(*bts, "bgr"))
@@ -98,15 +154,35 @@ NAN_METHOD(FixedPngStack::New)
             buf_type = BUF_RGBA;
         else if (str_eq(*bts, "bgra"))
             buf_type = BUF_BGRA;
+        else if (str_eq(*bts, "gray"))
+            buf_type = BUF_GRAY;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
         else
-            return NanThrowTypeError("Third argument wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Third argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+    }
+
+    EncodeOptions opts;
+    buffer_type canvas_type = with_alpha(buf_type);
+    blend_mode blend = BLEND_NONE;
+    bool cache_strips = false;
+    if (args.Length() >= 4) {
+        const char *err = parse_encode_options(args[3], opts);
+        if (!err)
+            err = parse_canvas_option(args[3], buf_type, canvas_type);
+        if (!err)
+            err = parse_blend_option(args[3], blend);
+        if (err)
+            return NanThrowTypeError(err);
+        if (args[3]->IsObject() && args[3]->ToObject()->Has(String::NewSymbol("stripCache")))
+            cache_strips = args[3]->ToObject()->Get(String::NewSymbol("stripCache"))->BooleanValue();
     }
 
     int width = args[0]->Int32Value();
     int height = args[1]->Int32Value();
 
     try {
-        FixedPngStack *png_stack = new FixedPngStack(width, height, buf_type);
+        FixedPngStack *png_stack = new FixedPngStack(width, height, buf_type, canvas_type, opts, blend, cache_strips);
         png_stack->Wrap(args.This());
         NanReturnValue(args.This());
     }
@@ -131,6 +207,8 @@ NAN_METHOD(FixedPngStack::Push)
         return NanThrowTypeError("Fifth argument must be integer h.");
 
     FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    if (png_stack->disposed)
+        return NanThrowError("FixedPngStack has been disposed.");
     int x = args[1]->Int32Value();
     int y = args[2]->Int32Value();
     int w = args[3]->Int32Value();
@@ -153,9 +231,16 @@ NAN_METHOD(FixedPngStack::Push)
     if (y+h > png_stack->height)
         return NanThrowRangeError("Pushed PNG exceeds FixedPngStack's height.");
 
+    blend_mode blend = png_stack->blend;
+    if (args.Length() >= 6) {
+        const char *err = parse_blend_option(args[5], blend);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
     char *buf_data = Buffer::Data(args[0]->ToObject());
 
-    png_stack->Push((unsigned char*)buf_data, x, y, w, h);
+    png_stack->Push((unsigned char*)buf_data, blend, x, y, w, h);
 
     NanReturnUndefined();
 }
@@ -165,21 +250,28 @@ NAN_METHOD(FixedPngStack::PngEncodeSync)
     NanScope();
 
     FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
-    NanReturnValue(png_stack->PngEncodeSync());
+    if (png_stack->disposed)
+        return NanThrowError("FixedPngStack has been disposed.");
+
+    EncodeOptions opts = png_stack->opts;
+    Local<Object> output;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
+    NanReturnValue(png_stack->PngEncodeSync(opts, output));
 }
 
 void FixedPngStack::FixedPngEncodeWorker::Execute() {
     try {
-        PngEncoder encoder(png_obj->data, png_obj->width, png_obj->height, png_obj->buf_type);
-        encoder.encode();
-        png_len =encoder.get_png_len();
-        png = (char *)malloc(sizeof(*png)*png_len);
-        if (!png) {
-            errmsg = strdup("malloc in FixedPngStack::UV_PngEncode failed.");
-        }
-        else {
-            memcpy(png,encoder.get_png(), png_len);
-        }
+        PngEncoder encoder(png_obj->data, png_obj->width, png_obj->height, png_obj->canvas_type, opts);
+        if (cached)
+            encoder.set_strip_cache(png_obj->strip_cache);
+        encode(encoder);
     }
     catch (const char *err) {
         errmsg = strdup(err);
@@ -189,26 +281,28 @@ void FixedPngStack::FixedPngEncodeWorker::Execute() {
 void FixedPngStack::FixedPngEncodeWorker::HandleOKCallback() {
     NanScope();
 
-    Local<Object> buf = NanNewBufferHandle(png_len);
-    memcpy(Buffer::Data(buf), png, png_len);
-    Local<Value> argv[2] = {buf, Undefined()};
+    Local<Value> buf = png_result();
+    png_obj->last_stats = stats;
+    Local<Value> argv[3] = {buf, Undefined(), stats_object(stats)};
 
     TryCatch try_catch; // don't quite see the necessity of this
 
-    callback->Call(2, argv);
+    callback->Call(3, argv);
 
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
-    free(png);
-    png = NULL;
-
+    if (cached)
+        png_obj->release_cache(true);
+    png_obj->encode_done();
     png_obj->Unref();
 }
 
 void FixedPngStack::FixedPngEncodeWorker::HandleErrorCallback() {
     NanScope();
 
+    record_failed_encode();
+
     Local<Value> argv[2] = {Undefined(), Exception::Error(String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -223,6 +317,9 @@ void FixedPngStack::FixedPngEncodeWorker::HandleErrorCallback() {
         png = NULL;
     }
 
+    if (cached)
+        png_obj->release_cache(false);
+    png_obj->encode_done();
     png_obj->Unref();
 }
 
@@ -230,19 +327,75 @@ NAN_METHOD(FixedPngStack::PngEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("Callback function required, optionally preceded by options.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
 
-    if (!args[0]->IsFunction())
-        return NanThrowTypeError("First argument must be a function.");
+    if (EncoderPool::full())
+        return NanThrowError("Too many encodes pending, see setMaxPendingEncodes.");
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     FixedPngStack *png = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    if (png->disposed)
+        return NanThrowError("FixedPngStack has been disposed.");
+
+    EncodeOptions opts = png->opts;
+    Local<Object> output;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (err)
+            return NanThrowTypeError(err);
+    }
 
-    NanAsyncQueueWorker(new FixedPngStack::FixedPngEncodeWorker(new NanCallback(callback), png));
+    bool cached = png->strip_cache && png->strip_cache->acquire(opts);
+    FixedPngStack::FixedPngEncodeWorker *worker = new FixedPngStack::FixedPngEncodeWorker(new NanCallback(callback), png, opts, cached);
+    if (!output.IsEmpty())
+        worker->set_output(output);
+    unsigned int id = EncoderPool::queue_worker(worker);
 
+    png->encoding++;
     png->Ref();
 
+    NanReturnValue(Integer::NewFromUnsigned(id));
+}
+
+NAN_METHOD(FixedPngStack::Stats)
+{
+    NanScope();
+    FixedPngStack *png = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    NanReturnValue(stats_object(png->last_stats));
+}
+
+NAN_METHOD(FixedPngStack::Reset)
+{
+    NanScope();
+
+    FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    if (png_stack->disposed)
+        return NanThrowError("FixedPngStack has been disposed.");
+    if (png_stack->encoding)
+        return NanThrowError("Can't reset while an encode is running.");
+
+    memset(png_stack->data, 0xFF,
+        (size_t)png_stack->width * png_stack->height * buffer_channels(png_stack->canvas_type));
+    if (png_stack->strip_cache)
+        png_stack->strip_cache->mark_all_dirty();
+
     NanReturnUndefined();
 }
 
+NAN_METHOD(FixedPngStack::Dispose)
+{
+    NanScope();
+
+    FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    png_stack->disposed = true;
+    if (!png_stack->encoding)
+        png_stack->free_data();
+
+    NanReturnUndefined();
+}
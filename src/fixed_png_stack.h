@@ -5,23 +5,37 @@
 #include <node_buffer.h>
 
 #include "common.h"
+#include "strip_cache.h"
 
 class FixedPngStack : public node::ObjectWrap {
     int width, height;
     unsigned char *data;
-    buffer_type buf_type;
+    buffer_type buf_type;     // layout of pushed buffers
+    buffer_type canvas_type;  // layout of data
+    EncodeOptions opts;
+    blend_mode blend;         // default of push's blend option
+    EncodeStats last_stats;
+    bool disposed;
+    int encoding;             // async encodes reading data
+    StripCache *strip_cache;  // NULL if disabled
+    size_t cache_bytes;       // held by strip_cache, as last reported to V8
+
+    void free_data();
+    void encode_done();
+    void release_cache(bool ok);
 
     static void UV_PngEncode(uv_work_t *req);
     static void UV_PngEncodeAfter(uv_work_t *req);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type);
+    FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type, buffer_type ccanvas_type,
+        const EncodeOptions &oopts, blend_mode bblend, bool cache_strips);
     ~FixedPngStack();
 
     class FixedPngEncodeWorker : public PngEncoder::EncodeWorker {
     public:
-        FixedPngEncodeWorker(NanCallback *callback, FixedPngStack *png) : PngEncoder::EncodeWorker(callback), png_obj(png) {
+        FixedPngEncodeWorker(NanCallback *callback, FixedPngStack *png, const EncodeOptions &opts, bool ccached) : PngEncoder::EncodeWorker(callback, opts), png_obj(png), cached(ccached) {
         };
 
         void Execute();
@@ -30,15 +44,19 @@ public:
 
     private:
         FixedPngStack *png_obj;
+        bool cached;    // has acquired png_obj's strip cache
     };
 
-    void Push(unsigned char *buf_data, int x, int y, int w, int h);
-    v8::Handle<v8::Value> PngEncodeSync();
+    void Push(unsigned char *buf_data, blend_mode push_blend, int x, int y, int w, int h);
+    v8::Handle<v8::Value> PngEncodeSync(const EncodeOptions &eopts, v8::Handle<v8::Object> output);
 
     static NAN_METHOD(New);
     static NAN_METHOD(Push);
     static NAN_METHOD(PngEncodeSync);
     static NAN_METHOD(PngEncodeAsync);
+    static NAN_METHOD(Stats);
+    static NAN_METHOD(Reset);
+    static NAN_METHOD(Dispose);
 };
 #endif
 
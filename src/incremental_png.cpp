@@ -0,0 +1,189 @@
+#include "common.h"
+#include "png_encoder.h"
+#include "incremental_png.h"
+
+using namespace v8;
+using namespace node;
+
+void
+IncrementalPng::Initialize(Handle<Object> target)
+{
+    NanScope();
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "begin", Begin);
+    NODE_SET_PROTOTYPE_METHOD(t, "writeRows", WriteRows);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", End);
+    target->Set(String::NewSymbol("IncrementalPng"), t->GetFunction());
+}
+
+IncrementalPng::IncrementalPng() :
+    encoder(NULL), width(0), height(0), buf_type(BUF_RGB) {}
+
+IncrementalPng::~IncrementalPng()
+{
+    delete encoder;
+}
+
+Handle<Value>
+IncrementalPng::Begin(int wwidth, int hheight, buffer_type bbuf_type, const EncodeOptions &opts)
+{
+    NanScope();
+
+    delete encoder;
+    encoder = NULL;
+
+    width = wwidth;
+    height = hheight;
+    buf_type = bbuf_type;
+
+    try {
+        encoder = new PngEncoder(NULL, width, height, buf_type, opts);
+        encoder->begin();
+        return scope.Close(Undefined());
+    }
+    catch (const char *err) {
+        delete encoder;
+        encoder = NULL;
+        return ThrowException(Exception::Error(String::New(err)));
+    }
+}
+
+Handle<Value>
+IncrementalPng::WriteRows(unsigned char *rows, int nrows)
+{
+    NanScope();
+
+    try {
+        encoder->write_rows(rows, nrows);
+        return scope.Close(Undefined());
+    }
+    catch (const char *err) {
+        return ThrowException(Exception::Error(String::New(err)));
+    }
+}
+
+Handle<Value>
+IncrementalPng::End()
+{
+    NanScope();
+
+    try {
+        encoder->end();
+        Local<Object> retbuf = encoder->get_buffer(Handle<Object>());
+        delete encoder;
+        encoder = NULL;
+        return scope.Close(retbuf);
+    }
+    catch (const char *err) {
+        delete encoder;
+        encoder = NULL;
+        return ThrowException(Exception::Error(String::New(err)));
+    }
+}
+
+NAN_METHOD(IncrementalPng::New)
+{
+    NanScope();
+
+    IncrementalPng *png = new IncrementalPng();
+    png->Wrap(args.This());
+    NanReturnValue(args.This());
+}
+
+NAN_METHOD(IncrementalPng::Begin)
+{
+    NanScope();
+
+    if (args.Length() < 2)
+        return NanThrowError("At least two arguments required - width, height, [input buffer type and options]");
+    if (!args[0]->IsInt32())
+        return NanThrowTypeError("First argument must be integer width.");
+    if (!args[1]->IsInt32())
+        return NanThrowTypeError("Second argument must be integer height.");
+
+    buffer_type buf_type = BUF_RGB;
+    if (args.Length() >= 3 && !args[2]->IsUndefined()) {
+        if (!args[2]->IsString())
+            return NanThrowTypeError("Third argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+
+        String::AsciiValue bts(args[2]->ToString());
+        if (str_eq(*bts, "rgb"))
+            buf_type = BUF_RGB;
+        else if (str_eq(*bts, "bgr"))
+            buf_type = BUF_BGR;
+        else if (str_eq(*bts, "rgba"))
+            buf_type = BUF_RGBA;
+        else if (str_eq(*bts, "bgra"))
+            buf_type = BUF_BGRA;
+        else if (str_eq(*bts, "gray"))
+            buf_type = BUF_GRAY;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
+        else
+            return NanThrowTypeError("Third argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+    }
+
+    int w = args[0]->Int32Value();
+    int h = args[1]->Int32Value();
+
+    if (w <= 0)
+        return NanThrowRangeError("Width smaller than 1.");
+    if (h <= 0)
+        return NanThrowRangeError("Height smaller than 1.");
+
+    EncodeOptions opts;
+    if (args.Length() >= 4) {
+        const char *err = parse_encode_options(args[3], opts);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
+    IncrementalPng *png = ObjectWrap::Unwrap<IncrementalPng>(args.This());
+    NanReturnValue(png->Begin(w, h, buf_type, opts));
+}
+
+NAN_METHOD(IncrementalPng::WriteRows)
+{
+    NanScope();
+
+    IncrementalPng *png = ObjectWrap::Unwrap<IncrementalPng>(args.This());
+    if (!png->encoder)
+        return NanThrowError("begin() must be called before writeRows().");
+
+    if (args.Length() < 1)
+        return NanThrowError("At least one argument required - data buffer [and number of rows].");
+    if (!Buffer::HasInstance(args[0]))
+        return NanThrowTypeError("First argument must be Buffer.");
+
+    size_t rowbytes = (size_t)png->width * buffer_channels(png->buf_type);
+    size_t buf_len = Buffer::Length(args[0]->ToObject());
+
+    int nrows = buf_len / rowbytes;
+    if (args.Length() >= 2 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsInt32())
+            return NanThrowTypeError("Second argument must be integer number of rows.");
+        nrows = args[1]->Int32Value();
+        if (nrows < 0)
+            return NanThrowRangeError("Number of rows smaller than 0.");
+        if ((size_t)nrows * rowbytes > buf_len)
+            return NanThrowRangeError("Buffer holds fewer rows than given.");
+    }
+
+    char *buf_data = Buffer::Data(args[0]->ToObject());
+
+    NanReturnValue(png->WriteRows((unsigned char *)buf_data, nrows));
+}
+
+NAN_METHOD(IncrementalPng::End)
+{
+    NanScope();
+
+    IncrementalPng *png = ObjectWrap::Unwrap<IncrementalPng>(args.This());
+    if (!png->encoder)
+        return NanThrowError("begin() must be called before end().");
+
+    NanReturnValue(png->End());
+}
+
@@ -0,0 +1,32 @@
+#ifndef INCREMENTAL_PNG_H
+#define INCREMENTAL_PNG_H
+
+#include <node.h>
+#include <node_buffer.h>
+
+#include "common.h"
+
+#include "png_encoder.h"
+
+class IncrementalPng : public node::ObjectWrap {
+    PngEncoder *encoder;
+    int width, height;
+    buffer_type buf_type;
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    IncrementalPng();
+    ~IncrementalPng();
+
+    v8::Handle<v8::Value> Begin(int wwidth, int hheight, buffer_type bbuf_type, const EncodeOptions &opts);
+    v8::Handle<v8::Value> WriteRows(unsigned char *rows, int nrows);
+    v8::Handle<v8::Value> End();
+
+    static NAN_METHOD(New);
+    static NAN_METHOD(Begin);
+    static NAN_METHOD(WriteRows);
+    static NAN_METHOD(End);
+};
+
+#endif
+
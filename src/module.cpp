@@ -3,6 +3,10 @@
 #include "png.h"
 #include "fixed_png_stack.h"
 #include "dynamic_png_stack.h"
+#include "incremental_png.h"
+#include "batch_encode.h"
+#include "encoder_pool.h"
+#include "encode_stats.h"
 
 extern "C" void
 init(v8::Handle<v8::Object> target)
@@ -12,6 +16,10 @@ init(v8::Handle<v8::Object> target)
     Png::Initialize(target);
     FixedPngStack::Initialize(target);
     DynamicPngStack::Initialize(target);
+    IncrementalPng::Initialize(target);
+    InitializeBatchEncode(target);
+    EncoderPool::Initialize(target);
+    InitializeEncodeStats(target);
 }
 
 NODE_MODULE(png, init)
@@ -0,0 +1,294 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <png.h>
+
+#include "parallel_deflate.h"
+#include "strip_cache.h"
+#include "encoder_pool.h"
+
+// Strips smaller than this are not worth a thread of their own.
+static const size_t MIN_STRIP_BYTES = 256*1024;
+
+// The filters of the first row of a standalone strip: those that don't look
+// at the row above.
+static int
+standalone_filters(int filters)
+{
+    int first = filters & (PNG_FILTER_NONE | PNG_FILTER_SUB);
+    return first ? first : PNG_FILTER_NONE;
+}
+
+class StripTask : public PoolTask {
+public:
+    const ParallelDeflate *encoder;
+    DeflateStrip *strip;
+
+    void run() { encoder->run_strip(*strip); }
+};
+
+ParallelDeflate::ParallelDeflate(unsigned char *ddata, int wwidth, int hheight,
+    buffer_type bbuf_type, const EncodeOptions &oopts) :
+    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type), opts(oopts),
+    filters(oopts.filters ? oopts.filters : PNG_ALL_FILTERS),
+    filter(wwidth, bbuf_type, filters), first_filter(wwidth, bbuf_type, standalone_filters(filters)),
+    standalone(false), strips(NULL), nstrips(0), own_strips(true), adler(0)
+{
+    rowbytes = filter.row_bytes();
+    level = opts.level >= 0 ? opts.level : Z_DEFAULT_COMPRESSION;
+
+    // libpng picks Z_FILTERED for filtered images unless told otherwise.
+    if (opts.strategy >= 0)
+        strategy = opts.strategy;
+    else
+        strategy = filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+}
+
+ParallelDeflate::~ParallelDeflate()
+{
+    if (own_strips)
+        delete [] strips;
+}
+
+int
+ParallelDeflate::strip_count(int max_strips) const
+{
+    size_t raw_len = (size_t)height * (rowbytes + 1);
+    size_t n = raw_len / MIN_STRIP_BYTES;
+    if (n > (size_t)max_strips)
+        n = max_strips;
+    if (n > (size_t)height)
+        n = height;
+    return n < 1 ? 1 : (int)n;
+}
+
+void
+ParallelDeflate::deflate_strip(DeflateStrip &strip) const
+{
+    int src_rowbytes = rowbytes;
+    size_t filtered_len = rowbytes + 1;
+
+    unsigned char *rows = (unsigned char *)malloc(2*rowbytes + 2*filtered_len);
+    if (!rows)
+        throw "malloc failed in node-png (ParallelDeflate::deflate_strip).";
+    unsigned char *cur = rows, *prev = rows + rowbytes;
+    unsigned char *filtered = rows + 2*rowbytes, *scratch = filtered + filtered_len;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, strategy) != Z_OK) {
+        free(rows);
+        throw "deflateInit2 failed in node-png (ParallelDeflate::deflate_strip).";
+    }
+
+    strip.raw_len = strip.nrows * filtered_len;
+    strip.mem_len = deflateBound(&zs, strip.raw_len) + 16;
+    strip.out = (unsigned char *)malloc(strip.mem_len);
+    if (!strip.out) {
+        deflateEnd(&zs);
+        free(rows);
+        throw "malloc failed in node-png (ParallelDeflate::deflate_strip).";
+    }
+    zs.next_out = strip.out;
+    zs.avail_out = strip.mem_len;
+    strip.adler = adler32(0, NULL, 0);
+
+    // The first row of a strip is filtered against the last row of the
+    // previous strip, exactly as in a single stream encode, unless strips
+    // are standalone.
+    if (strip.first_row > 0 && !standalone)
+        filter.transform_row(data + (size_t)(strip.first_row - 1)*src_rowbytes, prev);
+    else
+        memset(prev, 0, rowbytes);
+
+    int last_row = strip.first_row + strip.nrows - 1;
+    for (int y = strip.first_row; y <= last_row; y++) {
+        if ((y - strip.first_row) % CANCEL_CHECK_ROWS == 0 && cancelled(opts)) {
+            deflateEnd(&zs);
+            free(rows);
+            throw "Encode cancelled.";
+        }
+        filter.transform_row(data + (size_t)y*src_rowbytes, cur);
+        if (standalone && y == strip.first_row && y > 0)
+            first_filter.filter_row(cur, prev, filtered, scratch);
+        else
+            filter.filter_row(cur, prev, filtered, scratch);
+        strip.adler = adler32(strip.adler, filtered, filtered_len);
+
+        zs.next_in = filtered;
+        zs.avail_in = filtered_len;
+        int flush = y == last_row ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        for (;;) {
+            if (::deflate(&zs, flush) == Z_STREAM_ERROR) {
+                deflateEnd(&zs);
+                free(rows);
+                throw "deflate failed in node-png (ParallelDeflate::deflate_strip).";
+            }
+            if (zs.avail_out != 0)
+                break;
+
+            size_t used = strip.mem_len;
+            unsigned char *new_out = (unsigned char *)realloc(strip.out, strip.mem_len*2);
+            if (!new_out) {
+                deflateEnd(&zs);
+                free(rows);
+                throw "realloc failed in node-png (ParallelDeflate::deflate_strip).";
+            }
+            strip.out = new_out;
+            strip.mem_len *= 2;
+            zs.next_out = strip.out + used;
+            zs.avail_out = strip.mem_len - used;
+        }
+
+        unsigned char *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    strip.out_len = strip.mem_len - zs.avail_out;
+    deflateEnd(&zs);
+    free(rows);
+}
+
+void
+ParallelDeflate::run_strip(DeflateStrip &strip) const
+{
+    try {
+        deflate_strip(strip);
+    }
+    catch (const char *err) {
+        strip.errmsg = err;
+    }
+}
+
+size_t
+ParallelDeflate::compress(int n)
+{
+    if (own_strips)
+        delete [] strips;
+    own_strips = true;
+    nstrips = n < 1 ? 1 : n;
+    strips = new DeflateStrip[nstrips];
+
+    StripTask *jobs = new StripTask[nstrips];
+    PoolTask **tasks = new PoolTask *[nstrips];
+
+    int rows_per_strip = height / nstrips, extra = height % nstrips, row = 0;
+    for (int i = 0; i < nstrips; i++) {
+        strips[i].first_row = row;
+        strips[i].nrows = rows_per_strip + (i < extra ? 1 : 0);
+        row += strips[i].nrows;
+        jobs[i].encoder = this;
+        jobs[i].strip = &strips[i];
+        tasks[i] = &jobs[i];
+    }
+
+    EncoderPool::run_all(tasks, nstrips);
+
+    delete [] tasks;
+    delete [] jobs;
+
+    return combine_strips();
+}
+
+size_t
+ParallelDeflate::compress_cached(StripCache &cache, int max_threads)
+{
+    if (own_strips)
+        delete [] strips;
+    own_strips = false;
+    standalone = true;
+    strips = cache.get_strips();
+    nstrips = cache.count();
+
+    std::vector<StripTask> jobs;
+    for (int i = 0; i < nstrips; i++) {
+        if (!cache.is_stale(i))
+            continue;
+        free(strips[i].out);
+        strips[i].out = NULL;
+        strips[i].out_len = strips[i].mem_len = 0;
+        strips[i].errmsg = NULL;
+
+        StripTask job;
+        job.encoder = this;
+        job.strip = &strips[i];
+        jobs.push_back(job);
+    }
+
+    if (max_threads > 1 && jobs.size() > 1) {
+        std::vector<PoolTask *> tasks;
+        for (size_t i = 0; i < jobs.size(); i++)
+            tasks.push_back(&jobs[i]);
+        EncoderPool::run_all(&tasks[0], tasks.size());
+    }
+    else {
+        for (size_t i = 0; i < jobs.size(); i++)
+            jobs[i].run();
+    }
+
+    // Cached strips are kept at their compressed size, not deflateBound's.
+    for (size_t i = 0; i < jobs.size(); i++) {
+        DeflateStrip &strip = *jobs[i].strip;
+        if (strip.errmsg || !strip.out_len)
+            continue;
+        unsigned char *out = (unsigned char *)realloc(strip.out, strip.out_len);
+        if (out) {
+            strip.out = out;
+            strip.mem_len = strip.out_len;
+        }
+    }
+
+    return combine_strips();
+}
+
+// Checks the strips for failures, works out the Adler-32 of the whole
+// stream and returns its length.
+size_t
+ParallelDeflate::combine_strips()
+{
+    size_t total = 2 + 2 + 4;
+    adler = strips[0].adler;
+    for (int i = 0; i < nstrips; i++) {
+        if (strips[i].errmsg)
+            throw strips[i].errmsg;
+        total += strips[i].out_len;
+        if (i > 0)
+            adler = adler32_combine(adler, strips[i].adler, strips[i].raw_len);
+    }
+    return total;
+}
+
+void
+ParallelDeflate::write(stream_writer writer, void *ctx) const
+{
+    // zlib header: deflate with a 32K window, FLEVEL from the level.
+    int flevel;
+    if (level == Z_DEFAULT_COMPRESSION || level == 6)
+        flevel = 2;
+    else if (level < 2)
+        flevel = 0;
+    else if (level < 6)
+        flevel = 1;
+    else
+        flevel = 3;
+    int cmf = 0x78, flg = flevel << 6;
+    flg += 31 - ((cmf << 8) + flg) % 31;
+
+    unsigned char header[2] = { (unsigned char)cmf, (unsigned char)flg };
+    writer(ctx, header, 2);
+
+    for (int i = 0; i < nstrips; i++)
+        writer(ctx, strips[i].out, strips[i].out_len);
+
+    // An empty final fixed-Huffman block terminates the deflate stream,
+    // followed by the Adler-32 of all filtered bytes.
+    unsigned char trailer[6] = {
+        0x03, 0x00,
+        (unsigned char)((adler >> 24) & 0xFF), (unsigned char)((adler >> 16) & 0xFF),
+        (unsigned char)((adler >> 8) & 0xFF), (unsigned char)(adler & 0xFF)
+    };
+    writer(ctx, trailer, 6);
+}
+
@@ -0,0 +1,81 @@
+#ifndef PARALLEL_DEFLATE_H
+#define PARALLEL_DEFLATE_H
+
+#include <zlib.h>
+
+#include "common.h"
+#include "encode_options.h"
+#include "png_filter.h"
+
+// One horizontal band of the image. Its rows are filtered and deflated
+// independently of the other bands, so bands can go to separate threads.
+struct DeflateStrip {
+    int first_row, nrows;
+    unsigned char *out;   // raw deflate data ending on a byte aligned sync flush
+    size_t out_len, mem_len;
+    uLong adler;          // Adler-32 of the filtered bytes of this strip
+    size_t raw_len;       // number of filtered bytes fed to deflate
+    const char *errmsg;
+
+    DeflateStrip() : first_row(0), nrows(0), out(NULL), out_len(0), mem_len(0),
+        adler(0), raw_len(0), errmsg(NULL) {}
+    ~DeflateStrip() { free(out); }
+};
+
+typedef void (*stream_writer)(void *ctx, const unsigned char *data, size_t len);
+
+class StripCache;
+
+// Filters and deflates an image pigz style: the rows are split into strips
+// that are compressed concurrently, each ending with a sync flush, and then
+// concatenated into a single zlib stream with a combined Adler-32. The result
+// is the complete IDAT payload. Throws const char * on failure.
+class ParallelDeflate {
+    unsigned char *data;
+    int width, height;
+    buffer_type buf_type;
+    EncodeOptions opts;
+
+    int rowbytes;
+    int filters, level, strategy;
+    RowFilter filter;
+    RowFilter first_filter;   // for the first row of a standalone strip
+    bool standalone;
+
+    DeflateStrip *strips;
+    int nstrips;
+    bool own_strips;
+    uLong adler;
+
+    void deflate_strip(DeflateStrip &strip) const;
+    size_t combine_strips();
+
+public:
+    ParallelDeflate(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type,
+        const EncodeOptions &oopts);
+    ~ParallelDeflate();
+
+    // Deflates one strip, recording a failure in the strip. Runs on the
+    // encoder pool.
+    void run_strip(DeflateStrip &strip) const;
+
+    // Number of strips worth splitting this image into, at most max_strips.
+    int strip_count(int max_strips) const;
+
+    // Compresses the image into n strips and returns the length of the
+    // resulting zlib stream.
+    size_t compress(int n);
+
+    // Like compress(), with the strips of cache, deflating only those it
+    // marks stale on up to max_threads threads. Strips are made standalone:
+    // the first row of each is filtered with None or Sub only, so it
+    // doesn't depend on the strip above.
+    size_t compress_cached(StripCache &cache, int max_threads);
+
+    // Passes the compressed stream to writer piece by piece, so that it
+    // never has to be assembled in one block.
+    void write(stream_writer writer, void *ctx) const;
+};
+
+#endif
+
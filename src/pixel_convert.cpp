@@ -0,0 +1,376 @@
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixel_convert.h"
+
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+typedef void (*convert_fn)(const unsigned char *src, unsigned char *dst, int npixels);
+
+// Plain loops. The vector kernels below finish their last few pixels with
+// these.
+
+static void
+gray_add_alpha_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*2] = src[i];
+        dst[i*2 + 1] = 0x00;
+    }
+}
+
+static void
+rgb_add_alpha_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*4] = src[i*3];
+        dst[i*4 + 1] = src[i*3 + 1];
+        dst[i*4 + 2] = src[i*3 + 2];
+        dst[i*4 + 3] = 0x00;
+    }
+}
+
+static void
+graya_to_png_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*2] = src[i*2];
+        dst[i*2 + 1] = 255 - src[i*2 + 1];
+    }
+}
+
+static void
+bgr_to_png_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*3] = src[i*3 + 2];
+        dst[i*3 + 1] = src[i*3 + 1];
+        dst[i*3 + 2] = src[i*3];
+    }
+}
+
+static void
+rgba_to_png_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*4] = src[i*4];
+        dst[i*4 + 1] = src[i*4 + 1];
+        dst[i*4 + 2] = src[i*4 + 2];
+        dst[i*4 + 3] = 255 - src[i*4 + 3];
+    }
+}
+
+static void
+bgra_to_png_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*4] = src[i*4 + 2];
+        dst[i*4 + 1] = src[i*4 + 1];
+        dst[i*4 + 2] = src[i*4];
+        dst[i*4 + 3] = 255 - src[i*4 + 3];
+    }
+}
+
+static void
+rgba_drop_alpha_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*3] = src[i*4];
+        dst[i*3 + 1] = src[i*4 + 1];
+        dst[i*3 + 2] = src[i*4 + 2];
+    }
+}
+
+static void
+bgra_drop_alpha_plain(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        dst[i*3] = src[i*4 + 2];
+        dst[i*3 + 1] = src[i*4 + 1];
+        dst[i*3 + 2] = src[i*4];
+    }
+}
+
+#ifdef __SSE2__
+static void
+gray_add_alpha_sse2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= npixels; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i*2), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(dst + i*2 + 16), _mm_unpackhi_epi8(v, zero));
+    }
+    gray_add_alpha_plain(src + i, dst + i*2, npixels - i);
+}
+
+static void
+graya_to_png_sse2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i alpha_mask = _mm_set1_epi16((short)0xFF00);
+    int i = 0;
+    for (; i + 8 <= npixels; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*2));
+        _mm_storeu_si128((__m128i *)(dst + i*2), _mm_xor_si128(v, alpha_mask));
+    }
+    graya_to_png_plain(src + i*2, dst + i*2, npixels - i);
+}
+
+static void
+rgba_to_png_sse2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 4 <= npixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*4));
+        _mm_storeu_si128((__m128i *)(dst + i*4), _mm_xor_si128(v, alpha_mask));
+    }
+    rgba_to_png_plain(src + i*4, dst + i*4, npixels - i);
+}
+
+// Without a byte shuffle, B and R trade places by shifting them across
+// each 32-bit pixel.
+static void
+bgra_to_png_sse2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i br_mask = _mm_set1_epi32(0x00FF00FF);
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 4 <= npixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*4));
+        __m128i br = _mm_and_si128(v, br_mask);
+        __m128i ga = _mm_xor_si128(_mm_andnot_si128(br_mask, v), alpha_mask);
+        __m128i rb = _mm_or_si128(_mm_slli_epi32(br, 16), _mm_srli_epi32(br, 16));
+        _mm_storeu_si128((__m128i *)(dst + i*4), _mm_or_si128(ga, rb));
+    }
+    bgra_to_png_plain(src + i*4, dst + i*4, npixels - i);
+}
+#endif
+
+#ifdef HAVE_CPU_DISPATCH
+// 3 byte pixels are shuffled 16 bytes at a time, which also reads a bit of
+// the next pixels; the loops stop while those are still in src.
+
+__attribute__((target("ssse3"))) static void
+rgb_add_alpha_ssse3(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128,
+        6, 7, 8, -128, 9, 10, 11, -128);
+    int i = 0;
+    for (; i + 6 <= npixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*3));
+        _mm_storeu_si128((__m128i *)(dst + i*4), _mm_shuffle_epi8(v, shuffle));
+    }
+    rgb_add_alpha_plain(src + i*3, dst + i*4, npixels - i);
+}
+
+// Converts 5 pixels per 16 byte store. The 16th byte is rewritten by the
+// next store, or by the plain loop at the end.
+__attribute__((target("ssse3"))) static void
+bgr_to_png_ssse3(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6,
+        11, 10, 9, 14, 13, 12, 15);
+    int i = 0;
+    for (; i + 6 <= npixels; i += 5) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*3));
+        _mm_storeu_si128((__m128i *)(dst + i*3), _mm_shuffle_epi8(v, shuffle));
+    }
+    bgr_to_png_plain(src + i*3, dst + i*3, npixels - i);
+}
+
+__attribute__((target("ssse3"))) static void
+drop_alpha_ssse3(const unsigned char *src, unsigned char *dst, int npixels, __m128i shuffle)
+{
+    int i = 0;
+    for (; i + 4 <= npixels; i += 4) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i*4)), shuffle);
+        int last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        _mm_storel_epi64((__m128i *)(dst + i*3), v);
+        memcpy(dst + i*3 + 8, &last, 4);
+    }
+}
+
+__attribute__((target("ssse3"))) static void
+rgba_drop_alpha_ssse3(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    int n = npixels & ~3;
+    drop_alpha_ssse3(src, dst, n, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+        12, 13, 14, -128, -128, -128, -128));
+    rgba_drop_alpha_plain(src + n*4, dst + n*3, npixels - n);
+}
+
+__attribute__((target("ssse3"))) static void
+bgra_drop_alpha_ssse3(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    int n = npixels & ~3;
+    drop_alpha_ssse3(src, dst, n, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+        14, 13, 12, -128, -128, -128, -128));
+    bgra_drop_alpha_plain(src + n*4, dst + n*3, npixels - n);
+}
+
+__attribute__((target("avx2"))) static void
+rgb_add_alpha_avx2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128,
+        6, 7, 8, -128, 9, 10, 11, -128, 0, 1, 2, -128, 3, 4, 5, -128,
+        6, 7, 8, -128, 9, 10, 11, -128);
+    int i = 0;
+    for (; i + 10 <= npixels; i += 8) {
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i *)(src + i*3))),
+            _mm_loadu_si128((const __m128i *)(src + i*3 + 12)), 1);
+        _mm256_storeu_si256((__m256i *)(dst + i*4), _mm256_shuffle_epi8(v, shuffle));
+    }
+    rgb_add_alpha_plain(src + i*3, dst + i*4, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void
+rgba_to_png_avx2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 8 <= npixels; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i*4));
+        _mm256_storeu_si256((__m256i *)(dst + i*4), _mm256_xor_si256(v, alpha_mask));
+    }
+    rgba_to_png_plain(src + i*4, dst + i*4, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void
+bgra_to_png_avx2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+        14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m256i alpha_mask = _mm256_set1_epi32(0xFF000000);
+    int i = 0;
+    for (; i + 8 <= npixels; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i*4));
+        v = _mm256_xor_si256(_mm256_shuffle_epi8(v, shuffle), alpha_mask);
+        _mm256_storeu_si256((__m256i *)(dst + i*4), v);
+    }
+    bgra_to_png_plain(src + i*4, dst + i*4, npixels - i);
+}
+
+// Each 128-bit lane packs its 4 pixels into its low 12 bytes, then the two
+// halves are joined into 24 bytes.
+__attribute__((target("avx2"))) static void
+drop_alpha_avx2(const unsigned char *src, unsigned char *dst, int npixels, __m256i shuffle)
+{
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i = 0;
+    for (; i + 8 <= npixels; i += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + i*4)), shuffle);
+        v = _mm256_permutevar8x32_epi32(v, join);
+        _mm_storeu_si128((__m128i *)(dst + i*3), _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(dst + i*3 + 16), _mm256_extracti128_si256(v, 1));
+    }
+}
+
+__attribute__((target("avx2"))) static void
+rgba_drop_alpha_avx2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    int n = npixels & ~7;
+    drop_alpha_avx2(src, dst, n, _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+        12, 13, 14, -128, -128, -128, -128, 0, 1, 2, 4, 5, 6, 8, 9, 10,
+        12, 13, 14, -128, -128, -128, -128));
+    rgba_drop_alpha_plain(src + n*4, dst + n*3, npixels - n);
+}
+
+__attribute__((target("avx2"))) static void
+bgra_drop_alpha_avx2(const unsigned char *src, unsigned char *dst, int npixels)
+{
+    int n = npixels & ~7;
+    drop_alpha_avx2(src, dst, n, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+        14, 13, 12, -128, -128, -128, -128, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+        14, 13, 12, -128, -128, -128, -128));
+    bgra_drop_alpha_plain(src + n*4, dst + n*3, npixels - n);
+}
+#endif
+
+struct Kernels {
+    convert_fn gray_add_alpha, rgb_add_alpha;
+    convert_fn graya_to_png, bgr_to_png, rgba_to_png, bgra_to_png;
+    convert_fn rgba_drop_alpha, bgra_drop_alpha;
+};
+
+static Kernels
+pick_kernels()
+{
+    Kernels k = {
+        gray_add_alpha_plain, rgb_add_alpha_plain,
+        graya_to_png_plain, bgr_to_png_plain, rgba_to_png_plain, bgra_to_png_plain,
+        rgba_drop_alpha_plain, bgra_drop_alpha_plain
+    };
+    int features = cpu_features();
+
+#ifdef __SSE2__
+    if (features & CPU_SSE2) {
+        k.gray_add_alpha = gray_add_alpha_sse2;
+        k.graya_to_png = graya_to_png_sse2;
+        k.rgba_to_png = rgba_to_png_sse2;
+        k.bgra_to_png = bgra_to_png_sse2;
+    }
+#endif
+#ifdef HAVE_CPU_DISPATCH
+    if (features & CPU_SSSE3) {
+        k.rgb_add_alpha = rgb_add_alpha_ssse3;
+        k.bgr_to_png = bgr_to_png_ssse3;
+        k.rgba_drop_alpha = rgba_drop_alpha_ssse3;
+        k.bgra_drop_alpha = bgra_drop_alpha_ssse3;
+    }
+    if (features & CPU_AVX2) {
+        k.rgb_add_alpha = rgb_add_alpha_avx2;
+        k.rgba_to_png = rgba_to_png_avx2;
+        k.bgra_to_png = bgra_to_png_avx2;
+        k.rgba_drop_alpha = rgba_drop_alpha_avx2;
+        k.bgra_drop_alpha = bgra_drop_alpha_avx2;
+    }
+#endif
+    return k;
+}
+
+// Picked once, while the module loads and before any encode thread runs.
+static const Kernels kernels = pick_kernels();
+
+void add_alpha(const unsigned char *src, buffer_type src_type, unsigned char *dst, int npixels)
+{
+    if (buffer_channels(src_type) == 1)
+        kernels.gray_add_alpha(src, dst, npixels);
+    else
+        kernels.rgb_add_alpha(src, dst, npixels);
+}
+
+void to_png_order(const unsigned char *src, buffer_type buf_type, unsigned char *dst, int npixels)
+{
+    switch (buf_type) {
+    case BUF_GRAYA:
+        kernels.graya_to_png(src, dst, npixels);
+        break;
+    case BUF_BGR:
+        kernels.bgr_to_png(src, dst, npixels);
+        break;
+    case BUF_RGBA:
+        kernels.rgba_to_png(src, dst, npixels);
+        break;
+    case BUF_BGRA:
+        kernels.bgra_to_png(src, dst, npixels);
+        break;
+    default:
+        memcpy(dst, src, (size_t)npixels * buffer_channels(buf_type));
+    }
+}
+
+void drop_alpha(const unsigned char *src, buffer_type src_type, unsigned char *dst, int npixels)
+{
+    if (src_type == BUF_BGRA)
+        kernels.bgra_drop_alpha(src, dst, npixels);
+    else
+        kernels.rgba_drop_alpha(src, dst, npixels);
+}
@@ -0,0 +1,22 @@
+#ifndef PIXEL_CONVERT_H
+#define PIXEL_CONVERT_H
+
+#include "common.h"
+
+// Row conversions between pixel layouts, for pushes, composing and encoding.
+// Each runs with the widest vector instructions cpu_features() allows and
+// gives the same bytes as its plain loop. src and dst must not overlap.
+
+// Copies npixels pixels of src_type, which has no alpha, to dst as
+// with_alpha(src_type), with opaque alpha (0, alpha being inverted).
+void add_alpha(const unsigned char *src, buffer_type src_type, unsigned char *dst, int npixels);
+
+// Copies npixels pixels of buf_type to dst in PNG byte order: RGB rather
+// than BGR, and alpha not inverted. This is what png_set_bgr and
+// png_set_invert_alpha would do.
+void to_png_order(const unsigned char *src, buffer_type buf_type, unsigned char *dst, int npixels);
+
+// Copies npixels 'rgba' or 'bgra' pixels to dst as RGB, dropping alpha.
+void drop_alpha(const unsigned char *src, buffer_type src_type, unsigned char *dst, int npixels);
+
+#endif
@@ -1,7 +1,9 @@
 #include <cstring>
 #include <cstdlib>
+#include <zlib.h>
 #include "common.h"
 #include "png_encoder.h"
+#include "encoder_pool.h"
 #include "png.h"
 
 using namespace v8;
@@ -16,14 +18,15 @@ Png::Initialize(Handle<Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
     target->Set(String::NewSymbol("Png"), t->GetFunction());
 }
 
-Png::Png(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), buf_type(bbuf_type) {}
+Png::Png(int wwidth, int hheight, buffer_type bbuf_type, const EncodeOptions &oopts, pin_mode ppin) :
+    width(wwidth), height(hheight), buf_type(bbuf_type), opts(oopts), pin(ppin) {}
 
 Handle<Value>
-Png::PngEncodeSync()
+Png::PngEncodeSync(const EncodeOptions &eopts, Handle<Object> output)
 {
     NanScope();
 
@@ -32,14 +35,22 @@ Png::PngEncodeSync()
     char *buf_data = Buffer::Data(buf_val->ToObject());
 
     try {
-        PngEncoder encoder((unsigned char*)buf_data, width, height, buf_type);
+        uint64_t start = uv_hrtime();
+        PngEncoder encoder((unsigned char*)buf_data, width, height, buf_type, eopts);
+        if (!output.IsEmpty())
+            encoder.set_output(Buffer::Data(output), Buffer::Length(output));
         encoder.encode();
-        int png_len = encoder.get_png_len();
-        Local<Object> retbuf = NanNewBufferHandle(png_len);
-        memcpy(Buffer::Data(retbuf), encoder.get_png(), png_len);
-        return scope.Close(retbuf);
+        uint64_t encoded = uv_hrtime();
+        Local<Object> buf = encoder.get_buffer(output);
+
+        last_stats = encoder.get_stats();
+        last_stats.output_ns = uv_hrtime() - encoded;
+        last_stats.total_ns = uv_hrtime() - start;
+        record_encode(last_stats);
+        return scope.Close(buf);
     }
     catch (const char *err) {
+        record_failed_encode();
         return ThrowException(Exception::Error(String::New(err)));
     }
 }
@@ -49,7 +60,7 @@ NAN_METHOD(Png::New)
     NanScope();
 
     if (args.Length() < 3)
-        return NanThrowError("At least three arguments required - data buffer, width, height, [and input buffer type]");
+        return NanThrowError("At least three arguments required - data buffer, width, height, [input buffer type and options]");
     if (!Buffer::HasInstance(args[0]))
         return NanThrowTypeError("First argument must be Buffer.");
     if (!args[1]->IsInt32())
@@ -58,16 +69,16 @@ NAN_METHOD(Png::New)
         return NanThrowTypeError("Third argument must be integer height.");
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 4) {
+    if (args.Length() >= 4 && !args[3]->IsUndefined()) {
         if (!args[3]->IsString())
-            return NanThrowTypeError("Fourth argument must be 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Fourth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
 
         String::AsciiValue bts(args[3]->ToString());
         if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
             str_eq(*bts, "rgba") || str_eq(*bts, "bgra") ||
-            str_eq(*bts, "gray")))
+            str_eq(*bts, "gray") || str_eq(*bts, "graya")))
         {
-            return NanThrowTypeError("Fourth argument must be 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Fourth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
         }
 
         if (str_eq(*bts, "rgb"))
@@ -80,8 +91,10 @@ NAN_METHOD(Png::New)
             buf_type = BUF_BGRA;
         else if (str_eq(*bts, "gray"))
             buf_type = BUF_GRAY;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
         else
-            return NanThrowTypeError("Fourth argument wasn't 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return NanThrowTypeError("Fourth argument wasn't 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
     }
 
     int w = args[1]->Int32Value();
@@ -92,7 +105,17 @@ NAN_METHOD(Png::New)
     if (h < 0)
         return NanThrowRangeError("Height smaller than 0.");
 
-    Png *png = new Png(w, h, buf_type);
+    EncodeOptions opts;
+    pin_mode pin = PIN_NONE;
+    if (args.Length() >= 5) {
+        const char *err = parse_encode_options(args[4], opts);
+        if (!err)
+            err = parse_pin_option(args[4], pin);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
+    Png *png = new Png(w, h, buf_type, opts, pin);
     png->Wrap(args.This());
 
     // Save buffer.
@@ -105,49 +128,97 @@ NAN_METHOD(Png::PngEncodeSync)
 {
     NanScope();
     Png *png = ObjectWrap::Unwrap<Png>(args.This());
-    NanReturnValue(png->PngEncodeSync());
+
+    EncodeOptions opts = png->opts;
+    Local<Object> output;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
+    NanReturnValue(png->PngEncodeSync(opts, output));
+}
+
+Png::PngEncodeWorker::PngEncodeWorker(NanCallback *callback, Png *png, const EncodeOptions &opts,
+    char *buf_data, size_t bbuf_len, pin_mode ppin) :
+    PngEncoder::EncodeWorker(callback, opts, buf_data), png_obj(png), buf_len(bbuf_len), pin(ppin),
+    copy(NULL)
+{
+    if (pin == PIN_COPY) {
+        copy = (char *)malloc(buf_len);
+        if (copy) {
+            memcpy(copy, buf_data, buf_len);
+            this->buf_data = copy;
+        }
+    }
+}
+
+Png::PngEncodeWorker::~PngEncodeWorker()
+{
+    free(copy);
+}
+
+static uLong
+buffer_checksum(const char *data, size_t len)
+{
+    uLong sum = adler32(0L, Z_NULL, 0);
+    while (len > 0) {
+        uInt n = len > 0x40000000 ? 0x40000000 : (uInt)len;
+        sum = adler32(sum, (const Bytef *)data, n);
+        data += n;
+        len -= n;
+    }
+    return sum;
 }
 
 void Png::PngEncodeWorker::Execute() {
+    if (pin == PIN_COPY && !copy) {
+        errmsg = strdup("malloc failed in node-png (Png::PngEncodeWorker).");
+        return;
+    }
+
+    uLong sum = 0;
+    if (pin == PIN_CHECK)
+        sum = buffer_checksum(buf_data, buf_len);
+
     try {
-        PngEncoder encoder((unsigned char *)buf_data, png_obj->width, png_obj->height, png_obj->buf_type);
-        encoder.encode();
-        png_len = encoder.get_png_len();
-        png = (char *)malloc(sizeof(*png)*png_len);
-        if (!png) {
-            errmsg = strdup("malloc in Png::UV_PngEncode failed.");
-        } else {
-            memcpy(png, encoder.get_png(), png_len);
-        }
+        PngEncoder encoder((unsigned char *)buf_data, png_obj->width, png_obj->height, png_obj->buf_type, opts);
+        encode(encoder);
     }
     catch (const char *err) {
         errmsg = strdup(err);
+        return;
     }
+
+    if (pin == PIN_CHECK && buffer_checksum(buf_data, buf_len) != sum)
+        errmsg = strdup("Buffer changed during the encode.");
 }
 
 void Png::PngEncodeWorker::HandleOKCallback() {
     NanScope();
 
-    Local<Object> buf = NanNewBufferHandle(png_len);
-    memcpy(Buffer::Data(buf), png, png_len);
-    Local<Value> argv[2] = {buf, Undefined()};
+    Local<Value> buf = png_result();
+    png_obj->last_stats = stats;
+    Local<Value> argv[3] = {buf, Undefined(), stats_object(stats)};
 
     TryCatch try_catch; // don't quite see the necessity of this
 
-    callback->Call(2, argv);
+    callback->Call(3, argv);
 
     if (try_catch.HasCaught())
         FatalException(try_catch);
 
-    free(png);
-    png = NULL;
-
     png_obj->Unref();
 }
 
 void Png::PngEncodeWorker::HandleErrorCallback() {
     NanScope();
 
+    record_failed_encode();
+
     Local<Value> argv[2] = {Undefined(), Exception::Error(String::New(errmsg))};
 
     TryCatch try_catch; // don't quite see the necessity of this
@@ -169,22 +240,54 @@ NAN_METHOD(Png::PngEncodeAsync)
 {
     NanScope();
 
-    if (args.Length() != 1)
-        return NanThrowError("One argument required - callback function.");
+    if (args.Length() != 1 && args.Length() != 2)
+        return NanThrowError("Callback function required, optionally preceded by options.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return NanThrowTypeError("Last argument must be a function.");
 
-    if (!args[0]->IsFunction())
-        return NanThrowTypeError("First argument must be a function.");
+    if (EncoderPool::full())
+        return NanThrowError("Too many encodes pending, see setMaxPendingEncodes.");
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     Png *png = ObjectWrap::Unwrap<Png>(args.This());
 
+    EncodeOptions opts = png->opts;
+    pin_mode pin = png->pin;
+    Local<Object> output;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err)
+            err = parse_output_option(args[0], output);
+        if (!err)
+            err = parse_pin_option(args[0], pin);
+        if (err)
+            return NanThrowTypeError(err);
+    }
+
     // We need to pull out the buffer data before
     // we go to the thread pool.
     Local<Value> buf_val = NanObjectWrapHandle(png)->GetHiddenValue(String::New("buffer"));
+    Local<Object> buf_obj = buf_val->ToObject();
 
-    NanAsyncQueueWorker(new Png::PngEncodeWorker(new NanCallback(callback), png, Buffer::Data(buf_val->ToObject())));
+    Png::PngEncodeWorker *worker = new Png::PngEncodeWorker(new NanCallback(callback), png, opts,
+        Buffer::Data(buf_obj), Buffer::Length(buf_obj), pin);
+    if (!output.IsEmpty())
+        worker->set_output(output);
+
+    // The worker holds on to the Buffer itself, rather than relying on the
+    // Png object's reference to it.
+    worker->SavePersistent("buffer", buf_obj);
+    unsigned int id = EncoderPool::queue_worker(worker);
 
     png->Ref();
 
-    NanReturnUndefined();
+    NanReturnValue(Integer::NewFromUnsigned(id));
+}
+
+NAN_METHOD(Png::Stats)
+{
+    NanScope();
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    NanReturnValue(stats_object(png->last_stats));
 }
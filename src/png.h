@@ -12,16 +12,20 @@ class Png : public node::ObjectWrap {
     int width;
     int height;
     buffer_type buf_type;
+    EncodeOptions opts;
+    pin_mode pin;
+    EncodeStats last_stats;
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    Png(int wwidth, int hheight, buffer_type bbuf_type);
-    v8::Handle<v8::Value> PngEncodeSync();
+    Png(int wwidth, int hheight, buffer_type bbuf_type, const EncodeOptions &oopts, pin_mode ppin);
+    v8::Handle<v8::Value> PngEncodeSync(const EncodeOptions &eopts, v8::Handle<v8::Object> output);
 
     class PngEncodeWorker : public PngEncoder::EncodeWorker {
     public:
-        PngEncodeWorker(NanCallback *callback, Png *png, char *buf_data) : PngEncoder::EncodeWorker(callback, buf_data), png_obj(png) {
-        };
+        PngEncodeWorker(NanCallback *callback, Png *png, const EncodeOptions &opts, char *buf_data,
+            size_t buf_len, pin_mode pin);
+        ~PngEncodeWorker();
 
         void Execute();
         void HandleOKCallback();
@@ -29,11 +33,15 @@ public:
 
     private:
         Png *png_obj;
+        size_t buf_len;
+        pin_mode pin;
+        char *copy;     // the snapshot encoded with PIN_COPY
     };
 
     static NAN_METHOD(New);
     static NAN_METHOD(PngEncodeSync);
     static NAN_METHOD(PngEncodeAsync);
+    static NAN_METHOD(Stats);
 };
 
 #endif
@@ -0,0 +1,102 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <png.h>
+
+#include "png_buffer.h"
+
+PngBuffer::PngBuffer() : data(NULL), len(0), mem_len(0), external(false) {}
+
+PngBuffer::~PngBuffer()
+{
+    if (!external)
+        free(data);
+}
+
+void
+PngBuffer::grow(size_t min_len)
+{
+    size_t new_len = mem_len ? mem_len : 1024;
+    while (new_len < min_len)
+        new_len *= 2;
+
+    if (external) {
+        char *heap = (char *)malloc(new_len);
+        if (!heap)
+            throw "malloc failed in node-png (PngBuffer::grow).";
+        memcpy(heap, data, len);
+        data = heap;
+        external = false;
+    }
+    else {
+        char *new_data = (char *)realloc(data, new_len);
+        if (!new_data)
+            throw "realloc failed in node-png (PngBuffer::grow).";
+        data = new_data;
+    }
+    mem_len = new_len;
+}
+
+void
+PngBuffer::reserve(size_t n)
+{
+    if (n > mem_len)
+        grow(n);
+}
+
+void
+PngBuffer::append(const void *bytes, size_t n)
+{
+    if (len + n > mem_len)
+        grow(len + n);
+    memcpy(data + len, bytes, n);
+    len += n;
+}
+
+void
+PngBuffer::attach(char *mem, size_t size)
+{
+    if (!external)
+        free(data);
+    data = mem;
+    len = 0;
+    mem_len = size;
+    external = true;
+}
+
+void
+PngBuffer::shrink()
+{
+    if (external || !data || len == mem_len)
+        return;
+    char *new_data = (char *)realloc(data, len ? len : 1);
+    if (new_data) {
+        data = new_data;
+        mem_len = len ? len : 1;
+    }
+}
+
+char *
+PngBuffer::release()
+{
+    if (external)
+        return NULL;
+    char *p = data;
+    data = NULL;
+    len = mem_len = 0;
+    return p;
+}
+
+size_t
+PngBuffer::worst_case(int width, int height, buffer_type buf_type)
+{
+    size_t raw = (size_t)height * ((size_t)width * buffer_channels(buf_type) + 1);
+    // Same margin as zlib's deflateBound() for incompressible input, plus
+    // room for the sync flushes of a parallel encode.
+    size_t zlen = raw + (raw >> 12) + (raw >> 14) + (raw >> 25) + 13 + 64;
+    // libpng writes an IDAT chunk (12 bytes overhead) per PNG_ZBUF_SIZE.
+    size_t idat = zlen + 12*(zlen/PNG_ZBUF_SIZE + 1);
+    // Signature, IHDR, IEND and room for small ancillary chunks.
+    return idat + 8 + 25 + 12 + 1024;
+}
+
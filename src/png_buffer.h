@@ -0,0 +1,48 @@
+#ifndef PNG_BUFFER_H
+#define PNG_BUFFER_H
+
+#include <cstddef>
+
+#include "common.h"
+
+// Growable block that an encoded PNG is assembled in. It either owns heap
+// memory, which grows geometrically, or writes into memory attached by the
+// caller. When attached memory runs out, the contents move to the heap.
+class PngBuffer {
+    char *data;
+    size_t len, mem_len;
+    bool external;
+
+    void grow(size_t min_len);
+
+public:
+    PngBuffer();
+    ~PngBuffer();
+
+    // Makes sure that n bytes fit without further reallocation.
+    void reserve(size_t n);
+    void append(const void *bytes, size_t n);
+
+    // Writes into the caller's memory from now on, until it is full.
+    void attach(char *mem, size_t size);
+    bool is_external() const { return external; }
+
+    // Gives heap memory not used by the contents back to the allocator.
+    void shrink();
+
+    // Empties the buffer but keeps its memory for the next encode.
+    void clear() { len = 0; }
+
+    // Hands the heap block over to the caller, who must free() it.
+    char *release();
+
+    const char *get() const { return data; }
+    size_t length() const { return len; }
+
+    // Upper bound of the PNG size for an image with these dimensions, as if
+    // the pixels did not compress at all.
+    static size_t worst_case(int width, int height, buffer_type buf_type);
+};
+
+#endif
+
@@ -0,0 +1,107 @@
+#include <cstdlib>
+
+#include "common.h"
+#include "png_context_pool.h"
+
+#if PNG_LIBPNG_VER < 10400
+typedef png_size_t alloc_size;
+#else
+typedef png_alloc_size_t alloc_size;
+#endif
+
+// A write struct with its deflate state takes about 300kB; this leaves room
+// for a couple of them per thread.
+static const size_t MAX_CACHED_BYTES = 1024*1024;
+
+// Every block starts with its size, padded so that the memory handed to
+// libpng stays aligned for any type. A cached block keeps the link to the
+// next cached block right after the header.
+static const size_t HEADER_SIZE = 16;
+
+static THREAD_LOCAL char *cached_blocks;
+static THREAD_LOCAL size_t cached_bytes;
+
+static inline size_t &
+block_size(char *block)
+{
+    return *(size_t *)block;
+}
+
+static inline char *&
+next_block(char *block)
+{
+    return *(char **)(block + HEADER_SIZE);
+}
+
+static png_voidp
+pool_malloc(png_structp png_ptr, alloc_size size)
+{
+    for (char **link = &cached_blocks; *link; link = &next_block(*link)) {
+        char *block = *link;
+        if (block_size(block) == size) {
+            *link = next_block(block);
+            cached_bytes -= size;
+            return block + HEADER_SIZE;
+        }
+    }
+
+    char *block = (char *)malloc(HEADER_SIZE + size);
+    if (!block)
+        return NULL;
+    block_size(block) = size;
+    return block + HEADER_SIZE;
+}
+
+static void
+pool_free(png_structp png_ptr, png_voidp ptr)
+{
+    if (!ptr)
+        return;
+
+    char *block = (char *)ptr - HEADER_SIZE;
+    size_t size = block_size(block);
+    if (size < sizeof(char *) || size > MAX_CACHED_BYTES) {
+        free(block);
+        return;
+    }
+
+    next_block(block) = cached_blocks;
+    cached_blocks = block;
+    cached_bytes += size;
+
+    // Over the limit, drop the blocks that have been cached the longest;
+    // they are the ones an encode of a different size left behind.
+    if (cached_bytes > MAX_CACHED_BYTES) {
+        size_t kept = 0;
+        char *last = NULL;
+        for (char *b = cached_blocks; b; b = next_block(b)) {
+            if (kept + block_size(b) > MAX_CACHED_BYTES)
+                break;
+            kept += block_size(b);
+            last = b;
+        }
+        char *drop = last ? next_block(last) : cached_blocks;
+        if (last)
+            next_block(last) = NULL;
+        else
+            cached_blocks = NULL;
+        while (drop) {
+            char *next = next_block(drop);
+            free(drop);
+            drop = next;
+        }
+        cached_bytes = kept;
+    }
+}
+
+png_structp
+create_pooled_write_struct()
+{
+#ifdef PNG_USER_MEM_SUPPORTED
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+        NULL, pool_malloc, pool_free);
+#else
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+#endif
+}
+
@@ -0,0 +1,16 @@
+#ifndef PNG_CONTEXT_POOL_H
+#define PNG_CONTEXT_POOL_H
+
+#include <png.h>
+
+// libpng has no way to reset a write struct for the next image, so every
+// encode creates a new one, and with it a new ~256kB zlib deflate state.
+// Write structs created here get their memory from a small per-thread cache
+// of blocks instead: the blocks freed by png_destroy_write_struct are kept
+// and handed out again to the next struct created on the same thread, which
+// asks for the same sizes. For small images this avoids most of the cost of
+// setting up an encode.
+png_structp create_pooled_write_struct();
+
+#endif
+
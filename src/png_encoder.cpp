@@ -1,53 +1,237 @@
 #include <cstdlib>
+#include <cstring>
 
 #include "png_encoder.h"
+#include "parallel_deflate.h"
+#include "compressor.h"
+#include "png_filter.h"
+#include "png_context_pool.h"
+#include "reduce.h"
+#include "pixel_convert.h"
 #include "common.h"
 
 void
 PngEncoder::png_chunk_producer(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     PngEncoder *p = (PngEncoder *)png_get_io_ptr(png_ptr);
+    p->write_data(data, length);
+}
 
-    if (!p->png) {
-        p->png = (char *)malloc(sizeof(p->png)*41); // from tests pngs are at least 41 bytes
-        if (!p->png)
-            throw "malloc failed in node-png (PngEncoder::png_chunk_producer)";
-        p->mem_len = 41;
+void
+PngEncoder::write_data(const unsigned char *data, size_t len)
+{
+    stats.out_bytes += len;
+    if (!sink) {
+        png.append(data, len);
+        return;
     }
 
-    if (p->png_len + length > p->mem_len) {
-        char *new_png = (char *)realloc(p->png, sizeof(char)*p->png_len + length);
-        if (!new_png)
-            throw "realloc failed in node-png (PngEncoder::png_chunk_producer).";
-        p->png = new_png;
-        p->mem_len += length;
+    // Large writes are cut up so that the pieces stay around chunk_size.
+    size_t chunk_size = opts.chunk_size;
+    while (len) {
+        size_t n = chunk_size > png.length() ? chunk_size - png.length() : 0;
+        if (n > len)
+            n = len;
+        png.append(data, n);
+        data += n;
+        len -= n;
+        if (png.length() >= chunk_size)
+            flush_sink();
     }
-    memcpy(p->png + p->png_len, data, length);
-    p->png_len += length;
 }
 
-PngEncoder::PngEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) {
+void
+PngEncoder::flush_sink()
+{
+    png.shrink();
+    size_t len = png.length();
+    sink->emit(png.release(), len);
+    png.reserve(opts.chunk_size + PNG_ZBUF_SIZE);
+}
+
+PngEncoder::PngEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type,
+    const EncodeOptions &oopts) : opts(oopts), sink(NULL), png_ptr(NULL), info_ptr(NULL),
+    rows_written(0), rowbytes(0), png_row(NULL), format(NULL), strip_cache(NULL), source(NULL)
+{
     data = ddata;
     width = wwidth;
     height = hheight;
     buf_type = bbuf_type;
-    png = NULL;
-    png_len = 0;
-    mem_len = 0;
 }
 
 PngEncoder::~PngEncoder() {
-    free(png);
+    if (png_ptr)
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(png_row);
 }
 
 void
 PngEncoder::encode()
 {
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    PngFormat fmt;
+    unsigned char *rows = NULL;
+    check_cancelled(opts);
+
+    stats = EncodeStats();
+    stats.in_bytes = (uint64_t)width * height * buffer_channels(buf_type);
+    uint64_t start = uv_hrtime();
+    if (source) {
+        write_source();
+        stats.compress_ns = uv_hrtime() - start - stats.compose_ns;
+        return;
+    }
+    if (opts.palette)
+        rows = palette_image(data, width, height, buf_type, opts.colors, opts.dither, fmt);
+    else if (opts.reduce)
+        rows = reduce_image(data, width, height, buf_type, fmt);
+    uint64_t converted = uv_hrtime();
+    if (opts.palette || opts.reduce)
+        stats.convert_ns = converted - start;
+
+    if (!rows) {
+        begin_image(true);
+        write_image(data, width, buf_type);
+        stats.compress_ns = uv_hrtime() - converted;
+        return;
+    }
+
+    format = &fmt;
+    try {
+        begin_image(true);
+        write_image(rows, fmt.row_width, fmt.rows_type);
+    }
+    catch (const char *err) {
+        format = NULL;
+        free(rows);
+        throw;
+    }
+    format = NULL;
+    free(rows);
+    stats.compress_ns = uv_hrtime() - converted;
+}
+
+// Writes the image data after begin_image(), on whichever path the options ask
+// for. rows holds height rows of row_width pixels of rows_type.
+void
+PngEncoder::write_image(unsigned char *rows, int row_width, buffer_type rows_type)
+{
+    // libpng doesn't filter indexed images or ones of less than 8 bits per
+    // pixel unless told to.
+    EncodeOptions row_opts = opts;
+    bool unfiltered = format && (format->color_type == PNG_COLOR_TYPE_PALETTE || format->bit_depth < 8);
+    if (unfiltered && !row_opts.filters)
+        row_opts.filters = PNG_FILTER_NONE;
+
+    if (opts.backend != BACKEND_ZLIB) {
+        Compressor *c = Compressor::create(row_opts);
+        try {
+            write_compressed(*c, rows, row_width, rows_type, row_opts.filters);
+        }
+        catch (const char *err) {
+            delete c;
+            throw;
+        }
+        delete c;
+        finish();
+        return;
+    }
+
+    int max_strips = opts.threads > 0 ? opts.threads : cpu_count();
+    if (strip_cache && !format) {
+        ParallelDeflate pd(rows, row_width, height, rows_type, row_opts);
+        write_strips(pd, pd.compress_cached(*strip_cache, max_strips));
+        finish();
+        return;
+    }
+    if (max_strips > 1) {
+        ParallelDeflate pd(rows, row_width, height, rows_type, row_opts);
+        int nstrips = pd.strip_count(max_strips);
+        if (nstrips > 1) {
+            write_strips(pd, pd.compress(nstrips));
+            finish();
+            return;
+        }
+    }
+
+    for (int y = 0; y < height; y += CANCEL_CHECK_ROWS) {
+        check_cancelled(opts);
+        int nrows = height - y < CANCEL_CHECK_ROWS ? height - y : CANCEL_CHECK_ROWS;
+        write_rows(rows + (size_t)y*rowbytes, nrows);
+    }
+    end();
+}
+
+// Encodes the rows source produces, one band at a time, counting the time
+// source takes as compose time.
+void
+PngEncoder::write_source()
+{
+    if (!can_stream_rows(opts))
+        throw "These options need the whole image (PngEncoder::write_source).";
+
+    begin_image(false);
+    unsigned char *band = (unsigned char *)malloc(rowbytes * CANCEL_CHECK_ROWS);
+    if (!band)
+        throw "malloc failed in node-png (PngEncoder::write_source).";
+
+    try {
+        for (int y = 0; y < height; y += CANCEL_CHECK_ROWS) {
+            check_cancelled(opts);
+            int nrows = height - y < CANCEL_CHECK_ROWS ? height - y : CANCEL_CHECK_ROWS;
+            uint64_t t = uv_hrtime();
+            source->read_rows(band, y, nrows);
+            stats.compose_ns += uv_hrtime() - t;
+            write_rows(band, nrows);
+        }
+        end();
+    }
+    catch (const char *err) {
+        free(band);
+        throw;
+    }
+    free(band);
+}
+
+void
+PngEncoder::begin()
+{
+    if (opts.palette || opts.reduce)
+        throw "The palette and reduce options need the whole image (PngEncoder::begin).";
+    begin_image(false);
+}
+
+void
+PngEncoder::begin_image(bool whole_image)
+{
+    if (png_ptr)
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(png_row);
+    png_row = NULL;
+
+    png.clear();
+    rows_written = 0;
+    if (format)
+        rowbytes = (size_t)format->row_width * buffer_channels(format->rows_type);
+    else
+        rowbytes = (size_t)width * buffer_channels(buf_type);
+
+    // Reserving the worst case for a whole image up front means no
+    // reallocation during the encode; the pages that stay unused are
+    // returned by shrink() in finish(). An image written a few rows at a
+    // time starts small and grows with the PNG instead, so that memory
+    // follows the output rather than the image size.
+    if (!png.is_external())
+        png.reserve(sink || !whole_image ? opts.chunk_size + PNG_ZBUF_SIZE
+            : PngBuffer::worst_case(width, height, buf_type));
+
+    if (opts.reuse_context)
+        png_ptr = create_pooled_write_struct();
+    else
+        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
         throw "png_create_write_struct failed.";
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
+    info_ptr = png_create_info_struct(png_ptr);
     if (!info_ptr)
         throw "png_create_info_struct failed.";
 
@@ -60,61 +244,347 @@ PngEncoder::encode()
     case BUF_GRAY:
         color_type = PNG_COLOR_TYPE_GRAY;
         break;
+    case BUF_GRAYA:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
     default:
         color_type = PNG_COLOR_TYPE_RGB_ALPHA;
     }
+    if (format)
+        color_type = format->color_type;
 
     png_set_IHDR(png_ptr, info_ptr, width, height,
-        8, color_type, PNG_INTERLACE_NONE,
+        format ? format->bit_depth : 8, color_type, PNG_INTERLACE_NONE,
         PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-    png_bytep *row_pointers = NULL;
+    if (format)
+        set_format_chunks();
 
-    try {
-        png_set_write_fn(png_ptr, (void *)this, png_chunk_producer, NULL);
-        png_write_info(png_ptr, info_ptr);
-        png_set_invert_alpha(png_ptr);
-
-        if (buf_type == BUF_BGR || buf_type == BUF_BGRA)
-            png_set_bgr(png_ptr);
-
-        png_bytep *row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-        if (!row_pointers)
-            throw "malloc failed in node-png (PngEncoder::encode).";
-
-        switch (buf_type) {
-        case BUF_RGB:
-        case BUF_BGR:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+3*i*width;
-            break;
-        case BUF_GRAY:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+i*width;
-            break;
-        default:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+4*i*width;
+    if (opts.level >= 0)
+        png_set_compression_level(png_ptr, opts.level);
+    if (opts.strategy >= 0)
+        png_set_compression_strategy(png_ptr, opts.strategy);
+    if (opts.filters)
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, opts.filters);
+
+    png_set_write_fn(png_ptr, (void *)this, png_chunk_producer, NULL);
+    png_write_info(png_ptr, info_ptr);
+
+    // Rows that aren't in PNG byte order are converted one at a time on
+    // their way to libpng, rather than by its png_set_bgr and
+    // png_set_invert_alpha transforms, which go byte by byte.
+    // Of converted images, only gray with alpha keeps inverted alpha.
+    if (format ? format->rows_type != BUF_GRAYA : buf_type == BUF_RGB || buf_type == BUF_GRAY)
+        return;
+    png_row = (unsigned char *)malloc(rowbytes);
+    if (!png_row)
+        throw "malloc failed in node-png (PngEncoder::begin_image).";
+}
+
+// PLTE and tRNS for a converted image.
+void
+PngEncoder::set_format_chunks()
+{
+    if (format->color_type == PNG_COLOR_TYPE_PALETTE) {
+        const Palette &pal = format->palette;
+        png_color colors[256];
+        png_byte trans[256];
+        for (int i = 0; i < pal.ncolors; i++) {
+            colors[i].red = pal.rgba[i][0];
+            colors[i].green = pal.rgba[i][1];
+            colors[i].blue = pal.rgba[i][2];
+            trans[i] = pal.rgba[i][3];
         }
+        png_set_PLTE(png_ptr, info_ptr, colors, pal.ncolors);
+        if (pal.ntrans)
+            png_set_tRNS(png_ptr, info_ptr, trans, pal.ntrans, NULL);
+    }
+    else if (format->has_key) {
+        png_color_16 key;
+        memset(&key, 0, sizeof(key));
+        key.gray = format->key[0];
+        key.red = format->key[0];
+        key.green = format->key[1];
+        key.blue = format->key[2];
+        png_set_tRNS(png_ptr, info_ptr, NULL, 0, &key);
+    }
+}
 
-        png_write_image(png_ptr, row_pointers);
-        png_write_end(png_ptr, NULL);
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        free(row_pointers);
+void
+PngEncoder::write_rows(unsigned char *rows, int nrows)
+{
+    if (!png_ptr)
+        throw "Encoding has not begun (PngEncoder::write_rows).";
+    if (nrows > height - rows_written)
+        throw "More rows written than the image has (PngEncoder::write_rows).";
+
+    for (int i = 0; i < nrows; i++) {
+        unsigned char *row = rows + i*rowbytes;
+        if (png_row && format) {
+            to_png_order(row, format->rows_type, png_row, format->row_width);
+            row = png_row;
+        }
+        else if (png_row) {
+            to_png_order(row, buf_type, png_row, width);
+            row = png_row;
+        }
+        png_write_row(png_ptr, row);
+    }
+    rows_written += nrows;
+}
+
+void
+PngEncoder::end()
+{
+    if (!png_ptr)
+        throw "Encoding has not begun (PngEncoder::end).";
+    if (rows_written != height)
+        throw "Fewer rows written than the image has (PngEncoder::end).";
+
+    png_write_end(png_ptr, NULL);
+    finish();
+}
+
+void
+PngEncoder::finish()
+{
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    png_ptr = NULL;
+    info_ptr = NULL;
+    free(png_row);
+    png_row = NULL;
+
+    if (sink && png.length())
+        flush_sink();
+    png.shrink();
+}
+
+static void
+idat_writer(void *ctx, const unsigned char *data, size_t len)
+{
+    png_write_chunk_data((png_structp)ctx, (png_bytep)data, len);
+}
+
+void
+PngEncoder::write_strips(ParallelDeflate &pd, size_t idat_len)
+{
+    if (idat_len > PNG_UINT_31_MAX)
+        throw "Compressed image too large for one IDAT chunk (PngEncoder::write_strips).";
+
+    png_write_chunk_start(png_ptr, (png_bytep)"IDAT", idat_len);
+    pd.write(idat_writer, png_ptr);
+    png_write_chunk_end(png_ptr);
+    png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+}
+
+void
+PngEncoder::write_chunk(Compressor &c, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char head[8] = {
+        (unsigned char)((len >> 24) & 0xFF), (unsigned char)((len >> 16) & 0xFF),
+        (unsigned char)((len >> 8) & 0xFF), (unsigned char)(len & 0xFF),
+        (unsigned char)type[0], (unsigned char)type[1],
+        (unsigned char)type[2], (unsigned char)type[3]
+    };
+    unsigned long crc = c.crc32(0, head + 4, 4);
+    if (len)
+        crc = c.crc32(crc, data, len);
+    unsigned char tail[4] = {
+        (unsigned char)((crc >> 24) & 0xFF), (unsigned char)((crc >> 16) & 0xFF),
+        (unsigned char)((crc >> 8) & 0xFF), (unsigned char)(crc & 0xFF)
+    };
+
+    write_data(head, 8);
+    if (len)
+        write_data(data, len);
+    write_data(tail, 4);
+}
+
+// Filters the whole image into one buffer and has c compress it, then
+// writes IDAT and IEND with c's CRC-32. libpng still writes the header.
+void
+PngEncoder::write_compressed(Compressor &c, unsigned char *rows, int row_width,
+    buffer_type rows_type, int filters)
+{
+    RowFilter filter(row_width, rows_type, filters ? filters : PNG_ALL_FILTERS);
+    size_t row_len = filter.row_bytes(), filtered_len = row_len + 1;
+    size_t raw_len = (size_t)height * filtered_len;
+
+    unsigned char *raw = (unsigned char *)malloc(raw_len + 2*row_len + filtered_len);
+    if (!raw)
+        throw "malloc failed in node-png (PngEncoder::write_compressed).";
+    unsigned char *cur = raw + raw_len, *prev = cur + row_len, *scratch = prev + row_len;
+
+    memset(prev, 0, row_len);
+    for (int y = 0; y < height; y++) {
+        if (y % CANCEL_CHECK_ROWS == 0 && cancelled(opts)) {
+            free(raw);
+            throw "Encode cancelled.";
+        }
+        filter.transform_row(rows + (size_t)y*row_len, cur);
+        filter.filter_row(cur, prev, raw + (size_t)y*filtered_len, scratch);
+        unsigned char *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    unsigned char *idat = (unsigned char *)malloc(c.bound(raw_len));
+    if (!idat) {
+        free(raw);
+        throw "malloc failed in node-png (PngEncoder::write_compressed).";
+    }
+
+    size_t idat_len;
+    try {
+        check_cancelled(opts);
+        idat_len = c.compress(raw, raw_len, idat);
     }
     catch (const char *err) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        free(row_pointers);
+        free(idat);
+        free(raw);
         throw;
     }
+    free(raw);
+
+    if (idat_len > PNG_UINT_31_MAX) {
+        free(idat);
+        throw "Compressed image too large for one IDAT chunk (PngEncoder::write_compressed).";
+    }
+
+    write_chunk(c, "IDAT", idat, idat_len);
+    free(idat);
+    write_chunk(c, "IEND", NULL, 0);
 }
 
 const char *
 PngEncoder::get_png() const {
-    return png;
+    return png.get();
 }
 
 int
 PngEncoder::get_png_len() const {
-    return png_len;
+    return png.length();
+}
+
+const EncodeStats &
+PngEncoder::get_stats() const {
+    return stats;
 }
+
+void
+PngEncoder::set_output(char *mem, size_t size) {
+    png.attach(mem, size);
+}
+
+bool
+PngEncoder::wrote_to_output() const {
+    return png.is_external();
+}
+
+void
+PngEncoder::set_row_source(RowSource *ssource) {
+    source = ssource;
+}
+
+// The palette and reduce options look at every pixel before the first row
+// is written, and the other backends and threaded deflate filter the whole
+// image up front.
+bool
+PngEncoder::can_stream_rows(const EncodeOptions &opts) {
+    return !opts.palette && !opts.reduce && opts.backend == BACKEND_ZLIB && opts.threads == 1;
+}
+
+void
+PngEncoder::set_strip_cache(StripCache *cache) {
+    strip_cache = cache;
+}
+
+void
+PngEncoder::set_sink(PngChunkSink *ssink) {
+    sink = ssink;
+}
+
+char *
+PngEncoder::release_png() {
+    return png.release();
+}
+
+v8::Local<v8::Object>
+PngEncoder::get_buffer(v8::Handle<v8::Object> output) {
+    int png_len = png.length();
+    if (wrote_to_output())
+        return output_slice(output, png_len);
+    return png_buffer(release_png(), png_len);
+}
+
+v8::Local<v8::Object>
+PngEncoder::png_buffer(char *png, int png_len) {
+    return NanNewBufferHandle(png, png_len, free_png, NULL);
+}
+
+v8::Local<v8::Object>
+PngEncoder::output_slice(v8::Handle<v8::Object> output, int png_len) {
+    NanScope();
+
+    v8::Local<v8::Function> slice = v8::Local<v8::Function>::Cast(output->Get(v8::String::NewSymbol("slice")));
+    v8::Handle<v8::Value> argv[2] = {v8::Integer::New(0), v8::Integer::New(png_len)};
+    return scope.Close(slice->Call(output, 2, argv)->ToObject());
+}
+
+void
+PngEncoder::free_png(char *data, void *hint) {
+    free(data);
+}
+
+void
+PngEncoder::EncodeWorker::set_output(v8::Local<v8::Object> output) {
+    SavePersistent("output", output);
+    out_data = node::Buffer::Data(output);
+    out_len = node::Buffer::Length(output);
+}
+
+PngEncoder::EncodeWorker::~EncodeWorker() {
+    if (stream)
+        stream->close();
+}
+
+void
+PngEncoder::EncodeWorker::encode(PngEncoder &encoder) {
+    if (stream)
+        encoder.set_sink(stream);
+    else if (out_data)
+        encoder.set_output(out_data, out_len);
+    encoder.encode();
+    stats.add(encoder.get_stats());
+    png_len = encoder.get_png_len();
+    in_output = encoder.wrote_to_output();
+    if (!in_output)
+        png = encoder.release_png();
+}
+
+v8::Local<v8::Value>
+PngEncoder::EncodeWorker::png_result() {
+    uint64_t start = uv_hrtime();
+    v8::Local<v8::Value> result;
+    if (stream) {
+        stream->drain();
+        result = v8::Local<v8::Value>::New(v8::Null());
+    }
+    else if (in_output) {
+        result = output_slice(GetFromPersistent("output"), png_len);
+    }
+    else {
+        result = png_buffer(png, png_len);
+        png = NULL;
+    }
+
+    uint64_t now = uv_hrtime();
+    stats.output_ns = now - start;
+    if (queued_at) {
+        stats.queue_ns = started_at - queued_at;
+        stats.total_ns = now - queued_at;
+    }
+    record_encode(stats);
+    return result;
+}
+
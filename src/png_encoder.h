@@ -4,36 +4,151 @@
 #include <png.h>
 
 #include "common.h"
+#include "encode_options.h"
+#include "png_buffer.h"
+#include "png_stream.h"
+#include "encoder_pool.h"
+#include "encode_stats.h"
 #include "nan.h"
 
+class ParallelDeflate;
+class StripCache;
+class Compressor;
+struct PngFormat;
+
+// Produces the rows of an image that's never held in memory whole, for
+// PngEncoder::set_row_source().
+class RowSource {
+public:
+    virtual ~RowSource() {}
+
+    // Fills rows with nrows rows starting at row y, laid out as they would
+    // be in the whole image buffer.
+    virtual void read_rows(unsigned char *rows, int y, int nrows) = 0;
+};
+
 class PngEncoder {
     int width, height;
     unsigned char *data;
-    char *png;
-    unsigned int png_len, mem_len;
+    PngBuffer png;
     buffer_type buf_type;
+    EncodeOptions opts;
+    PngChunkSink *sink;
+
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int rows_written;
+    size_t rowbytes;
+    unsigned char *png_row;   // a row in PNG byte order, if rows need converting
+
+    // Set while an image converted to another PNG format (an indexed one,
+    // or a smaller one found by reduce) is encoded.
+    const PngFormat *format;
+    StripCache *strip_cache;
+    RowSource *source;
+    EncodeStats stats;
+
+    void begin_image(bool whole_image);
+    void set_format_chunks();
+    void write_image(unsigned char *rows, int row_width, buffer_type rows_type);
+    void write_source();
+    void flush_sink();
+    void write_data(const unsigned char *data, size_t len);
+    void write_chunk(Compressor &c, const char *type, const unsigned char *data, size_t len);
+    void write_strips(ParallelDeflate &pd, size_t idat_len);
+    void write_compressed(Compressor &c, unsigned char *rows, int row_width,
+        buffer_type rows_type, int filters);
+    void finish();
 
 public:
-    PngEncoder(unsigned char *ddata, int width, int hheight, buffer_type bbuf_type);
+    PngEncoder(unsigned char *ddata, int width, int hheight, buffer_type bbuf_type,
+        const EncodeOptions &oopts = EncodeOptions());
     ~PngEncoder();
 
-    class EncodeWorker : public NanAsyncWorker {
+    class EncodeWorker : public PoolWorker {
     public:
-        EncodeWorker(NanCallback *callback, char *buf_data=NULL) : NanAsyncWorker(callback), png(NULL), png_len(0), buf_data(buf_data) {
+        EncodeWorker(NanCallback *callback, const EncodeOptions &opts, char *buf_data=NULL) : PoolWorker(callback), png(NULL), png_len(0), buf_data(buf_data), opts(opts), out_data(NULL), out_len(0), in_output(false), stream(NULL) {
               png = NULL;
               png_len = 0;
+              this->opts.cancel = cancel_flag();
+              if (opts.stream)
+                  stream = new PngStream(callback);
         };
+        ~EncodeWorker();
+
+        // Encodes into the caller's Buffer (the output option) if it fits.
+        void set_output(v8::Local<v8::Object> output);
+
+        const EncodeStats &get_stats() const { return stats; }
 
     protected:
         char *png;
         int png_len;
         char *buf_data;
+        EncodeOptions opts;
+        char *out_data;
+        size_t out_len;
+        bool in_output;
+        PngStream *stream;
+        EncodeStats stats;
+
+        // Runs encoder on the worker thread and takes over its result.
+        void encode(PngEncoder &encoder);
+        // Returns the result as a Buffer on the main thread. When streaming,
+        // passes the last chunks to the callback and returns null instead.
+        // Completes stats and adds them to the process-wide ones.
+        v8::Local<v8::Value> png_result();
     };
 
     static void png_chunk_producer(png_structp png_ptr, png_bytep data, png_size_t length);
     void encode();
+
+    // Encodes the image a band of rows at a time, for producers that never
+    // hold all of it in memory: begin(), then write_rows() until height
+    // rows are written, then end(). The data given to the constructor is
+    // not used. Rows are laid out as in the whole image buffer.
+    void begin();
+    void write_rows(unsigned char *rows, int nrows);
+    void end();
+
     const char *get_png() const;
     int get_png_len() const;
+
+    // Time spent in encode() and bytes in and out.
+    const EncodeStats &get_stats() const;
+
+    // Makes the encoder write into mem instead of allocating, as long as the
+    // PNG fits in size bytes. Reusing mem avoids all output allocations.
+    void set_output(char *mem, size_t size);
+    bool wrote_to_output() const;
+
+    // Makes encode() read the image from source a band of rows at a time
+    // instead of from the data given to the constructor, so that it never
+    // has to exist in one piece. Only for options can_stream_rows() allows.
+    void set_row_source(RowSource *ssource);
+    static bool can_stream_rows(const EncodeOptions &opts);
+
+    // Deflates the image with the strips of cache, which the caller has
+    // acquired for this encode, so that only its stale strips are redone.
+    void set_strip_cache(StripCache *cache);
+
+    // Hands the output to sink in pieces of about chunk_size bytes while
+    // encoding, instead of collecting the whole PNG.
+    void set_sink(PngChunkSink *ssink);
+
+    // The encoded PNG as a Buffer: a slice of output if it was written
+    // there, otherwise a Buffer that owns the encoder's memory.
+    v8::Local<v8::Object> get_buffer(v8::Handle<v8::Object> output);
+
+    // Hands the encoded PNG over to the caller, who becomes responsible for
+    // freeing it (usually by passing it to png_buffer).
+    char *release_png();
+
+    // Wraps a released PNG in a Buffer that takes ownership of the memory,
+    // so the encoded bytes are never copied on their way to JavaScript.
+    static v8::Local<v8::Object> png_buffer(char *png, int png_len);
+    static v8::Local<v8::Object> output_slice(v8::Handle<v8::Object> output, int png_len);
+    static void free_png(char *data, void *hint);
 };
 
 #endif
@@ -0,0 +1,123 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <png.h>
+
+#include "png_filter.h"
+#include "pixel_convert.h"
+
+static inline int
+paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static void
+apply_filter(int type, const unsigned char *row, const unsigned char *prev,
+    int rowbytes, int bpp, unsigned char *out)
+{
+    out[0] = type;
+    unsigned char *o = out + 1;
+    int i;
+
+    switch (type) {
+    case PNG_FILTER_VALUE_NONE:
+        memcpy(o, row, rowbytes);
+        break;
+    case PNG_FILTER_VALUE_SUB:
+        for (i = 0; i < bpp; i++)
+            o[i] = row[i];
+        for (; i < rowbytes; i++)
+            o[i] = row[i] - row[i-bpp];
+        break;
+    case PNG_FILTER_VALUE_UP:
+        for (i = 0; i < rowbytes; i++)
+            o[i] = row[i] - prev[i];
+        break;
+    case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < bpp; i++)
+            o[i] = row[i] - (prev[i] >> 1);
+        for (; i < rowbytes; i++)
+            o[i] = row[i] - ((row[i-bpp] + prev[i]) >> 1);
+        break;
+    default:
+        for (i = 0; i < bpp; i++)
+            o[i] = row[i] - paeth_predictor(0, prev[i], 0);
+        for (; i < rowbytes; i++)
+            o[i] = row[i] - paeth_predictor(row[i-bpp], prev[i], prev[i-bpp]);
+    }
+}
+
+// Same heuristic as libpng: the filtered row with the smallest sum of
+// absolute values (taken as signed bytes) usually deflates best.
+static unsigned long
+filtered_cost(const unsigned char *out, int rowbytes)
+{
+    unsigned long sum = 0;
+    for (int i = 1; i <= rowbytes; i++)
+        sum += out[i] < 128 ? out[i] : 256 - out[i];
+    return sum;
+}
+
+RowFilter::RowFilter(int wwidth, buffer_type bbuf_type, int ffilters) :
+    width(wwidth), buf_type(bbuf_type), filters(ffilters)
+{
+    channels = buffer_channels(buf_type);
+    rowbytes = width * channels;
+}
+
+void
+RowFilter::transform_row(const unsigned char *src, unsigned char *dst) const
+{
+    to_png_order(src, buf_type, dst, width);
+}
+
+void
+RowFilter::filter_row(const unsigned char *row, const unsigned char *prev,
+    unsigned char *out, unsigned char *scratch) const
+{
+    static const int types[] = {
+        PNG_FILTER_VALUE_NONE, PNG_FILTER_VALUE_SUB, PNG_FILTER_VALUE_UP,
+        PNG_FILTER_VALUE_AVG, PNG_FILTER_VALUE_PAETH
+    };
+    static const int flags[] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+        PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+
+    int candidates = 0, only = 0;
+    for (int i = 0; i < 5; i++) {
+        if (filters & flags[i]) {
+            candidates++;
+            only = types[i];
+        }
+    }
+
+    if (candidates == 1) {
+        apply_filter(only, row, prev, rowbytes, channels, out);
+        return;
+    }
+
+    unsigned long best_cost = 0;
+    bool have_best = false;
+    for (int i = 0; i < 5; i++) {
+        if (!(filters & flags[i]))
+            continue;
+        apply_filter(types[i], row, prev, rowbytes, channels, scratch);
+        unsigned long cost = filtered_cost(scratch, rowbytes);
+        if (!have_best || cost < best_cost) {
+            memcpy(out, scratch, rowbytes + 1);
+            best_cost = cost;
+            have_best = true;
+        }
+    }
+}
+
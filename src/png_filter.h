@@ -0,0 +1,32 @@
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+#include "common.h"
+
+// Does to rows what libpng's write path does before compressing them:
+// converts them to PNG byte order and applies the row filters. Used by the
+// encode paths that deflate the image data themselves.
+class RowFilter {
+    int width, channels, rowbytes;
+    buffer_type buf_type;
+    int filters;
+
+public:
+    // filters is a mask of PNG_FILTER_* flags to pick from.
+    RowFilter(int wwidth, buffer_type bbuf_type, int ffilters);
+
+    int row_bytes() const { return rowbytes; }
+
+    // Converts a source row to PNG byte order with to_png_order(), as the
+    // libpng path does.
+    void transform_row(const unsigned char *src, unsigned char *dst) const;
+
+    // Filters a transformed row against the previous one into out, which
+    // takes rowbytes + 1 bytes including the filter type byte. scratch must
+    // be as large as out.
+    void filter_row(const unsigned char *row, const unsigned char *prev,
+        unsigned char *out, unsigned char *scratch) const;
+};
+
+#endif
+
@@ -0,0 +1,75 @@
+#include <cstdlib>
+
+#include "png_encoder.h"
+#include "png_stream.h"
+
+using namespace v8;
+
+PngStream::PngStream(NanCallback *ccallback) : callback(ccallback)
+{
+    uv_mutex_init(&mutex);
+    uv_cond_init(&drained);
+    uv_async_init(uv_default_loop(), &async, async_cb);
+    async.data = this;
+}
+
+PngStream::~PngStream()
+{
+    for (vChunk::iterator it = chunks.begin(); it != chunks.end(); ++it)
+        free(it->first);
+    uv_cond_destroy(&drained);
+    uv_mutex_destroy(&mutex);
+}
+
+void
+PngStream::emit(char *block, size_t len)
+{
+    uv_mutex_lock(&mutex);
+    while (chunks.size() >= MAX_QUEUED)
+        uv_cond_wait(&drained, &mutex);
+    chunks.push_back(std::make_pair(block, len));
+    uv_mutex_unlock(&mutex);
+    uv_async_send(&async);
+}
+
+void
+PngStream::drain()
+{
+    NanScope();
+
+    vChunk ready;
+    uv_mutex_lock(&mutex);
+    ready.swap(chunks);
+    uv_cond_signal(&drained);
+    uv_mutex_unlock(&mutex);
+
+    for (vChunk::iterator it = ready.begin(); it != ready.end(); ++it) {
+        Local<Value> argv[1] = {PngEncoder::png_buffer(it->first, it->second)};
+
+        TryCatch try_catch;
+
+        callback->Call(1, argv);
+
+        if (try_catch.HasCaught())
+            node::FatalException(try_catch);
+    }
+}
+
+void
+PngStream::close()
+{
+    uv_close((uv_handle_t *)&async, close_cb);
+}
+
+void
+PngStream::async_cb(uv_async_t *handle, int status)
+{
+    ((PngStream *)handle->data)->drain();
+}
+
+void
+PngStream::close_cb(uv_handle_t *handle)
+{
+    delete (PngStream *)handle->data;
+}
+
@@ -0,0 +1,51 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <utility>
+#include <vector>
+
+#include "nan.h"
+
+// Receives the encoded PNG piece by piece while it is being produced.
+class PngChunkSink {
+public:
+    virtual ~PngChunkSink() {}
+
+    // Takes ownership of a malloc'd block of len bytes.
+    virtual void emit(char *block, size_t len) = 0;
+};
+
+// Passes chunks produced on a worker thread to a JavaScript callback on the
+// main thread, as soon as the event loop gets to them. When MAX_QUEUED
+// chunks are waiting for the event loop, emit() blocks the worker until
+// they are handed over, so a busy main thread doesn't end up holding the
+// whole PNG.
+class PngStream : public PngChunkSink {
+    typedef std::vector<std::pair<char *, size_t> > vChunk;
+
+    static const size_t MAX_QUEUED = 4;
+
+    uv_async_t async;
+    uv_mutex_t mutex;
+    uv_cond_t drained;
+    vChunk chunks;
+    NanCallback *callback;
+
+    static void async_cb(uv_async_t *handle, int status);
+    static void close_cb(uv_handle_t *handle);
+    ~PngStream();
+
+public:
+    PngStream(NanCallback *callback);
+
+    void emit(char *block, size_t len);
+
+    // Calls callback with every chunk emitted so far. Main thread only.
+    void drain();
+
+    // Drops pending chunks and frees the stream once libuv is done with it.
+    void close();
+};
+
+#endif
+
@@ -0,0 +1,374 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "quantize.h"
+
+// Median cut works on a histogram of colors reduced to 5 bits per color
+// channel and 4 bits of alpha, which keeps it small for photo-like images.
+static const int BIN_BITS = 19;
+
+static inline unsigned int
+color_key(const unsigned char *c)
+{
+    return ((unsigned int)c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+}
+
+static inline unsigned int
+bin_key(const unsigned char *c)
+{
+    return ((c[0] >> 3) << 14) | ((c[1] >> 3) << 9) | ((c[2] >> 3) << 4) | (c[3] >> 4);
+}
+
+// Collects the colors of the image into pal as long as there are at most
+// max_colors of them. Returns false if there are more.
+static bool
+exact_palette(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, Palette &pal, unsigned char *indices)
+{
+    static const unsigned int TABLE_SIZE = 1024;
+    unsigned int keys[TABLE_SIZE];
+    short slots[TABLE_SIZE];
+    memset(slots, -1, sizeof(slots));
+
+    int channels = buffer_channels(buf_type);
+    size_t npixels = (size_t)width * height;
+    unsigned int last_key = 0;
+    int last_index = -1;
+    unsigned char c[4];
+
+    pal.ncolors = 0;
+    for (size_t i = 0; i < npixels; i++) {
+        read_rgba(data + i*channels, buf_type, c);
+        unsigned int key = color_key(c);
+        if (key == last_key && last_index >= 0) {
+            indices[i] = last_index;
+            continue;
+        }
+
+        unsigned int h = (key * 2654435761u) >> 22;
+        while (slots[h] >= 0 && keys[h] != key)
+            h = (h + 1) & (TABLE_SIZE - 1);
+        if (slots[h] < 0) {
+            if (pal.ncolors == max_colors)
+                return false;
+            keys[h] = key;
+            slots[h] = pal.ncolors;
+            memcpy(pal.rgba[pal.ncolors], c, 4);
+            pal.ncolors++;
+        }
+        last_key = key;
+        last_index = slots[h];
+        indices[i] = last_index;
+    }
+    return true;
+}
+
+struct ColorBin {
+    unsigned int count;
+    double sum[4];
+    float mean[4];
+    int box;
+};
+
+struct ColorBox {
+    int begin, end;   // range of bins
+    double count;
+    float range;      // widest spread of the bin means over one channel
+    int channel;      // the channel with that spread
+};
+
+struct BinOrder {
+    const std::vector<ColorBin> *bins;
+    int channel;
+    bool operator()(int a, int b) const {
+        return (*bins)[a].mean[channel] < (*bins)[b].mean[channel];
+    }
+};
+
+static void
+measure_box(ColorBox &box, const std::vector<ColorBin> &bins, const std::vector<int> &order)
+{
+    float lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+    box.count = 0;
+    for (int i = box.begin; i < box.end; i++) {
+        const ColorBin &bin = bins[order[i]];
+        box.count += bin.count;
+        for (int ch = 0; ch < 4; ch++) {
+            lo[ch] = std::min(lo[ch], bin.mean[ch]);
+            hi[ch] = std::max(hi[ch], bin.mean[ch]);
+        }
+    }
+    box.range = 0;
+    box.channel = 0;
+    for (int ch = 0; ch < 4; ch++) {
+        if (hi[ch] - lo[ch] > box.range) {
+            box.range = hi[ch] - lo[ch];
+            box.channel = ch;
+        }
+    }
+}
+
+// Splits the histogram into at most max_colors boxes, always splitting the
+// box with the most pixels times spread at the weighted median of its
+// widest channel, and makes each box's mean color a palette entry.
+static void
+median_cut(std::vector<ColorBin> &bins, int max_colors, Palette &pal)
+{
+    std::vector<int> order(bins.size());
+    for (size_t i = 0; i < bins.size(); i++)
+        order[i] = i;
+
+    std::vector<ColorBox> boxes(1);
+    boxes[0].begin = 0;
+    boxes[0].end = bins.size();
+    measure_box(boxes[0], bins, order);
+
+    while ((int)boxes.size() < max_colors) {
+        int best = -1;
+        double best_score = 0;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            double score = boxes[i].range * boxes[i].count;
+            if (boxes[i].end - boxes[i].begin > 1 && score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best < 0)
+            break;
+
+        ColorBox &box = boxes[best];
+        BinOrder by_channel = { &bins, box.channel };
+        std::sort(order.begin() + box.begin, order.begin() + box.end, by_channel);
+
+        double half = box.count / 2, seen = 0;
+        int split = box.begin + 1;
+        for (int i = box.begin; i < box.end - 1; i++) {
+            seen += bins[order[i]].count;
+            split = i + 1;
+            if (seen >= half)
+                break;
+        }
+
+        ColorBox upper;
+        upper.begin = split;
+        upper.end = box.end;
+        box.end = split;
+        measure_box(box, bins, order);
+        measure_box(upper, bins, order);
+        boxes.push_back(upper);
+    }
+
+    pal.ncolors = boxes.size();
+    for (size_t b = 0; b < boxes.size(); b++) {
+        double sum[4] = { 0, 0, 0, 0 }, count = 0;
+        for (int i = boxes[b].begin; i < boxes[b].end; i++) {
+            ColorBin &bin = bins[order[i]];
+            bin.box = b;
+            count += bin.count;
+            for (int ch = 0; ch < 4; ch++)
+                sum[ch] += bin.sum[ch];
+        }
+        for (int ch = 0; ch < 4; ch++)
+            pal.rgba[b][ch] = (unsigned char)(sum[ch] / count + 0.5);
+    }
+}
+
+static int
+nearest_color(const Palette &pal, const int *c)
+{
+    int best = 0, best_dist = 0x7FFFFFFF;
+    for (int i = 0; i < pal.ncolors; i++) {
+        int dist = 0;
+        for (int ch = 0; ch < 4; ch++) {
+            int d = c[ch] - pal.rgba[i][ch];
+            dist += d*d;
+        }
+        if (dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+static inline int
+clamp_channel(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Floyd-Steinberg: each pixel takes the color nearest to it plus the error
+// carried over from its neighbours, and passes its own error on to the
+// pixels right and below. Nearest colors are cached per histogram bin.
+static void
+dither_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    const Palette &pal, unsigned char *indices)
+{
+    int channels = buffer_channels(buf_type);
+    std::vector<short> nearest(1 << BIN_BITS, -1);
+    std::vector<int> err_cur((width + 2) * 4, 0), err_next((width + 2) * 4, 0);
+    unsigned char c[4];
+
+    for (int y = 0; y < height; y++) {
+        std::fill(err_next.begin(), err_next.end(), 0);
+        for (int x = 0; x < width; x++) {
+            read_rgba(data + ((size_t)y*width + x)*channels, buf_type, c);
+            int *e = &err_cur[(x + 1) * 4];
+            int want[4];
+            unsigned char want8[4];
+            for (int ch = 0; ch < 4; ch++) {
+                want[ch] = clamp_channel(c[ch] + e[ch] / 16);
+                want8[ch] = want[ch];
+            }
+
+            unsigned int bin = bin_key(want8);
+            if (nearest[bin] < 0)
+                nearest[bin] = nearest_color(pal, want);
+            int index = nearest[bin];
+            indices[(size_t)y*width + x] = index;
+
+            int *right = e + 4, *below = &err_next[(x + 1) * 4];
+            for (int ch = 0; ch < 4; ch++) {
+                int d = want[ch] - pal.rgba[index][ch];
+                right[ch] += d * 7;
+                below[ch - 4] += d * 3;
+                below[ch] += d * 5;
+                below[ch + 4] += d;
+            }
+        }
+        err_cur.swap(err_next);
+    }
+}
+
+static void
+median_cut_palette(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, bool dither, Palette &pal, unsigned char *indices)
+{
+    int channels = buffer_channels(buf_type);
+    size_t npixels = (size_t)width * height;
+    std::vector<int> bin_of(1 << BIN_BITS, -1);
+    std::vector<ColorBin> bins;
+    unsigned char c[4];
+
+    for (size_t i = 0; i < npixels; i++) {
+        read_rgba(data + i*channels, buf_type, c);
+        unsigned int key = bin_key(c);
+        if (bin_of[key] < 0) {
+            ColorBin bin;
+            memset(&bin, 0, sizeof(bin));
+            bin_of[key] = bins.size();
+            bins.push_back(bin);
+        }
+        ColorBin &bin = bins[bin_of[key]];
+        bin.count++;
+        for (int ch = 0; ch < 4; ch++)
+            bin.sum[ch] += c[ch];
+    }
+    for (size_t i = 0; i < bins.size(); i++) {
+        for (int ch = 0; ch < 4; ch++)
+            bins[i].mean[ch] = bins[i].sum[ch] / bins[i].count;
+    }
+
+    median_cut(bins, max_colors, pal);
+
+    if (dither) {
+        dither_image(data, width, height, buf_type, pal, indices);
+        return;
+    }
+    for (size_t i = 0; i < npixels; i++) {
+        read_rgba(data + i*channels, buf_type, c);
+        indices[i] = bins[bin_of[bin_key(c)]].box;
+    }
+}
+
+// Moves the entries that aren't opaque to the front of the palette.
+static void
+sort_transparent_first(Palette &pal, unsigned char *indices, size_t npixels)
+{
+    unsigned char map[256];
+    unsigned char rgba[256][4];
+    int n = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < pal.ncolors; i++) {
+            if ((pal.rgba[i][3] < 255) == (pass == 0)) {
+                map[i] = n;
+                memcpy(rgba[n++], pal.rgba[i], 4);
+            }
+        }
+        if (pass == 0)
+            pal.ntrans = n;
+    }
+    memcpy(pal.rgba, rgba, pal.ncolors * 4);
+
+    bool identity = true;
+    for (int i = 0; i < pal.ncolors; i++)
+        identity = identity && map[i] == i;
+    if (identity)
+        return;
+    for (size_t i = 0; i < npixels; i++)
+        indices[i] = map[indices[i]];
+}
+
+bool
+exact_quantize(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, Palette &pal, unsigned char *indices)
+{
+    if (!exact_palette(data, width, height, buf_type, max_colors, pal, indices))
+        return false;
+    sort_transparent_first(pal, indices, (size_t)width * height);
+    return true;
+}
+
+void
+quantize(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, bool dither, Palette &pal, unsigned char *indices)
+{
+    if (max_colors < 1 || max_colors > 256)
+        throw "Palette size must be between 1 and 256 (quantize).";
+
+    if (exact_quantize(data, width, height, buf_type, max_colors, pal, indices))
+        return;
+    median_cut_palette(data, width, height, buf_type, max_colors, dither, pal, indices);
+    sort_transparent_first(pal, indices, (size_t)width * height);
+}
+
+int
+palette_bit_depth(int ncolors)
+{
+    if (ncolors <= 2)
+        return 1;
+    if (ncolors <= 4)
+        return 2;
+    if (ncolors <= 16)
+        return 4;
+    return 8;
+}
+
+int
+pack_indices(unsigned char *indices, int width, int height, int bit_depth)
+{
+    int packed_rowbytes = (width * bit_depth + 7) / 8;
+    if (bit_depth == 8)
+        return packed_rowbytes;
+
+    // Packed rows never overtake the rows they're packed from, so this can
+    // work in place.
+    int per_byte = 8 / bit_depth;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *src = indices + (size_t)y*width;
+        unsigned char *dst = indices + (size_t)y*packed_rowbytes;
+        for (int x = 0; x < width; x += per_byte) {
+            unsigned char b = 0;
+            for (int k = 0; k < per_byte; k++) {
+                b <<= bit_depth;
+                if (x + k < width)
+                    b |= src[x + k];
+            }
+            *dst++ = b;
+        }
+    }
+    return packed_rowbytes;
+}
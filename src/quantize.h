@@ -0,0 +1,67 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "common.h"
+
+// Colors of an indexed PNG in PNG byte order (RGBA, alpha not inverted).
+// The entries that aren't opaque come first, so the tRNS chunk only needs
+// ntrans entries.
+struct Palette {
+    int ncolors;
+    int ntrans;
+    unsigned char rgba[256][4];
+
+    Palette() : ncolors(0), ntrans(0) {}
+};
+
+// Reads a pixel as PNG RGBA. Fully transparent pixels all become the same
+// color, as their RGB values don't show.
+inline void
+read_rgba(const unsigned char *p, buffer_type buf_type, unsigned char *c)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        c[0] = p[0]; c[1] = p[1]; c[2] = p[2]; c[3] = 255;
+        return;
+    case BUF_BGR:
+        c[0] = p[2]; c[1] = p[1]; c[2] = p[0]; c[3] = 255;
+        return;
+    case BUF_GRAY:
+        c[0] = c[1] = c[2] = p[0]; c[3] = 255;
+        return;
+    case BUF_GRAYA:
+        c[0] = c[1] = c[2] = p[0]; c[3] = 255 - p[1];
+        break;
+    case BUF_RGBA:
+        c[0] = p[0]; c[1] = p[1]; c[2] = p[2]; c[3] = 255 - p[3];
+        break;
+    default:
+        c[0] = p[2]; c[1] = p[1]; c[2] = p[0]; c[3] = 255 - p[3];
+        break;
+    }
+    if (c[3] == 0)
+        c[0] = c[1] = c[2] = 0;
+}
+
+// Maps every pixel of the image to an entry of a palette of at most
+// max_colors colors, writing one index per pixel to indices. If the image
+// has no more colors than that, the palette holds them exactly; otherwise
+// it's made by median cut, and dither spreads the error Floyd-Steinberg
+// style. Throws const char * on failure.
+void quantize(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, bool dither, Palette &pal, unsigned char *indices);
+
+// Like quantize, but only succeeds (returning true) if the image has at
+// most max_colors colors.
+bool exact_quantize(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, Palette &pal, unsigned char *indices);
+
+// The smallest PNG bit depth that can index ncolors colors.
+int palette_bit_depth(int ncolors);
+
+// Packs rows of 8 bit indices (or gray samples) in place into rows of
+// bit_depth bits per pixel and returns the length of a packed row.
+int pack_indices(unsigned char *indices, int width, int height, int bit_depth);
+
+#endif
+
@@ -0,0 +1,345 @@
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <png.h>
+
+#include "reduce.h"
+#include "pixel_convert.h"
+
+struct ImageScan {
+    bool opaque;        // every pixel is opaque
+    bool binary_alpha;  // every pixel is either opaque or fully transparent
+    bool gray;          // R=G=B in every pixel that isn't fully transparent
+};
+
+// Scans 4 channel pixels. Alpha in the buffer is inverted, so an opaque
+// pixel has alpha 0 and a fully transparent one 255. The byte order of the
+// color channels doesn't matter for any of the checks.
+static void
+scan_4ch(const unsigned char *data, size_t npixels, ImageScan &scan)
+{
+    unsigned int alpha_or = 0, not_binary = 0, not_gray = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_mask = _mm_set1_epi32(0xFF000000);
+    const __m128i gray_mask = _mm_set1_epi32(0x0000FFFF);
+    __m128i acc_alpha = zero, acc_binary = zero, acc_gray = zero;
+
+    // Four pixels at a time: R^G and G^B are in the low two bytes of
+    // v ^ (v >> 8), so those are zero for gray pixels.
+    for (; i + 4 <= npixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i*4));
+        __m128i a = _mm_and_si128(v, alpha_mask);
+        __m128i transparent = _mm_cmpeq_epi32(a, alpha_mask);
+        __m128i binary = _mm_or_si128(_mm_cmpeq_epi32(a, zero), transparent);
+        __m128i diff = _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), gray_mask);
+
+        acc_alpha = _mm_or_si128(acc_alpha, a);
+        acc_binary = _mm_or_si128(acc_binary, _mm_xor_si128(binary, _mm_cmpeq_epi32(zero, zero)));
+        acc_gray = _mm_or_si128(acc_gray, _mm_andnot_si128(transparent, diff));
+
+        // Nothing left to find out once all three checks have failed.
+        if ((i & 1023) == 0 &&
+            _mm_movemask_epi8(_mm_cmpeq_epi8(acc_binary, zero)) != 0xFFFF &&
+            _mm_movemask_epi8(_mm_cmpeq_epi8(acc_gray, zero)) != 0xFFFF)
+            break;
+    }
+    alpha_or = _mm_movemask_epi8(_mm_cmpeq_epi8(acc_alpha, zero)) != 0xFFFF;
+    not_binary = _mm_movemask_epi8(_mm_cmpeq_epi8(acc_binary, zero)) != 0xFFFF;
+    not_gray = _mm_movemask_epi8(_mm_cmpeq_epi8(acc_gray, zero)) != 0xFFFF;
+    if (not_binary && not_gray)
+        i = npixels;
+#endif
+
+    for (; i < npixels; i++) {
+        const unsigned char *p = data + i*4;
+        alpha_or |= p[3];
+        not_binary |= p[3] != 0 && p[3] != 255;
+        if (p[3] != 255)
+            not_gray |= (p[0] ^ p[1]) | (p[1] ^ p[2]);
+    }
+
+    scan.opaque = alpha_or == 0;
+    scan.binary_alpha = !not_binary;
+    scan.gray = !not_gray;
+}
+
+static void
+scan_image(const unsigned char *data, int width, int height, buffer_type buf_type, ImageScan &scan)
+{
+    size_t npixels = (size_t)width * height;
+    scan.opaque = scan.binary_alpha = scan.gray = true;
+
+    switch (buf_type) {
+    case BUF_GRAY:
+        return;
+    case BUF_RGB:
+    case BUF_BGR: {
+        unsigned int not_gray = 0;
+        for (size_t i = 0; i < npixels && !not_gray; i++) {
+            const unsigned char *p = data + i*3;
+            not_gray |= (p[0] ^ p[1]) | (p[1] ^ p[2]);
+        }
+        scan.gray = !not_gray;
+        return;
+    }
+    case BUF_GRAYA: {
+        unsigned int alpha_or = 0, not_binary = 0;
+        for (size_t i = 0; i < npixels; i++) {
+            unsigned char a = data[i*2 + 1];
+            alpha_or |= a;
+            not_binary |= a != 0 && a != 255;
+        }
+        scan.opaque = alpha_or == 0;
+        scan.binary_alpha = !not_binary;
+        return;
+    }
+    default:
+        scan_4ch(data, npixels, scan);
+    }
+}
+
+// Finds the lowest bit depth that holds all gray levels in seen exactly,
+// plus a free level for the color key if one is needed. Returns 0 if even
+// 8 bits won't do (all 256 levels are used and a key is needed).
+static int
+gray_depth(const bool *seen, bool need_key, int &key)
+{
+    for (int depth = 1; depth <= 8; depth *= 2) {
+        int levels = 1 << depth, step = 255 / (levels - 1);
+        bool fits = true;
+        for (int v = 0; v < 256 && fits; v++)
+            fits = !seen[v] || v % step == 0;
+        if (!fits)
+            continue;
+        if (!need_key)
+            return depth;
+        for (int l = 0; l < levels; l++) {
+            if (!seen[l * step]) {
+                key = l;
+                return depth;
+            }
+        }
+    }
+    return 0;
+}
+
+// A color key can replace the alpha channel without touching any pixel if
+// all transparent pixels already have the same color, and no visible pixel
+// has it. Returns whether that's so, with the color in key.
+static bool
+rgb_key(const unsigned char *data, int width, int height, buffer_type buf_type, int *key)
+{
+    size_t npixels = (size_t)width * height;
+    bool bgr = buf_type == BUF_BGRA, found = false;
+
+    for (size_t i = 0; i < npixels; i++) {
+        const unsigned char *p = data + i*4;
+        if (p[3] != 255)
+            continue;
+        int r = bgr ? p[2] : p[0], g = p[1], b = bgr ? p[0] : p[2];
+        if (!found) {
+            key[0] = r;
+            key[1] = g;
+            key[2] = b;
+            found = true;
+        }
+        else if (r != key[0] || g != key[1] || b != key[2])
+            return false;
+    }
+    if (!found)
+        return false;
+
+    for (size_t i = 0; i < npixels; i++) {
+        const unsigned char *p = data + i*4;
+        if (p[3] == 255)
+            continue;
+        int r = bgr ? p[2] : p[0], g = p[1], b = bgr ? p[0] : p[2];
+        if (r == key[0] && g == key[1] && b == key[2])
+            return false;
+    }
+    return true;
+}
+
+static unsigned char *
+gray_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int depth, PngFormat &format)
+{
+    int channels = buffer_channels(buf_type), step = 255 / ((1 << depth) - 1);
+    size_t npixels = (size_t)width * height;
+    unsigned char *rows = (unsigned char *)malloc(npixels);
+    if (!rows)
+        throw "malloc failed in node-png (gray_image).";
+
+    unsigned char c[4];
+    for (size_t i = 0; i < npixels; i++) {
+        read_rgba(data + i*channels, buf_type, c);
+        rows[i] = c[3] ? c[0] / step : format.key[0];
+    }
+
+    format.color_type = PNG_COLOR_TYPE_GRAY;
+    format.bit_depth = depth;
+    format.row_width = pack_indices(rows, width, height, depth);
+    format.rows_type = BUF_GRAY;
+    return rows;
+}
+
+static unsigned char *
+rgb_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    PngFormat &format)
+{
+    int channels = buffer_channels(buf_type);
+    size_t npixels = (size_t)width * height;
+    unsigned char *rows = (unsigned char *)malloc(npixels * 3);
+    if (!rows)
+        throw "malloc failed in node-png (rgb_image).";
+
+    if (!format.has_key) {
+        for (int y = 0; y < height; y++)
+            drop_alpha(data + (size_t)y*width*channels, buf_type, rows + (size_t)y*width*3, width);
+    }
+    else {
+        unsigned char c[4];
+        for (size_t i = 0; i < npixels; i++) {
+            read_rgba(data + i*channels, buf_type, c);
+            unsigned char *p = rows + i*3;
+            for (int ch = 0; ch < 3; ch++)
+                p[ch] = c[3] ? c[ch] : format.key[ch];
+        }
+    }
+
+    format.color_type = PNG_COLOR_TYPE_RGB;
+    format.bit_depth = 8;
+    format.row_width = width;
+    format.rows_type = BUF_RGB;
+    return rows;
+}
+
+// Gray with an alpha channel, for gray images with translucent pixels. The
+// rows keep the buffer's inverted alpha, as BUF_GRAYA rows, and go to PNG
+// order on the encode paths like any other rows of that type.
+static unsigned char *
+gray_alpha_image(const unsigned char *data, int width, int height, PngFormat &format)
+{
+    size_t npixels = (size_t)width * height;
+    unsigned char *rows = (unsigned char *)malloc(npixels * 2);
+    if (!rows)
+        throw "malloc failed in node-png (gray_alpha_image).";
+
+    // G is the second byte of 'rgba' and 'bgra' pixels alike.
+    for (size_t i = 0; i < npixels; i++) {
+        rows[i*2] = data[i*4 + 1];
+        rows[i*2 + 1] = data[i*4 + 3];
+    }
+
+    format.color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+    format.bit_depth = 8;
+    format.row_width = width;
+    format.rows_type = BUF_GRAYA;
+    return rows;
+}
+
+unsigned char *
+palette_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, bool dither, PngFormat &format)
+{
+    unsigned char *indices = (unsigned char *)malloc((size_t)width * height);
+    if (!indices)
+        throw "malloc failed in node-png (palette_image).";
+
+    try {
+        quantize(data, width, height, buf_type, max_colors, dither, format.palette, indices);
+    }
+    catch (const char *err) {
+        free(indices);
+        throw;
+    }
+
+    format.color_type = PNG_COLOR_TYPE_PALETTE;
+    format.bit_depth = palette_bit_depth(format.palette.ncolors);
+    format.row_width = pack_indices(indices, width, height, format.bit_depth);
+    format.rows_type = BUF_GRAY;
+    return indices;
+}
+
+unsigned char *
+reduce_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    PngFormat &format)
+{
+    ImageScan scan;
+    scan_image(data, width, height, buf_type, scan);
+
+    int channels = buffer_channels(buf_type);
+    size_t npixels = (size_t)width * height;
+    int best_bits = channels * 8;
+    enum { KEEP, GRAY, GRAY_ALPHA, RGB } choice = KEEP;
+    int depth = 8;
+
+    if (scan.gray && scan.binary_alpha) {
+        bool seen[256];
+        memset(seen, 0, sizeof(seen));
+        unsigned char c[4];
+        for (size_t i = 0; i < npixels; i++) {
+            read_rgba(data + i*channels, buf_type, c);
+            if (c[3])
+                seen[c[0]] = true;
+        }
+        depth = gray_depth(seen, !scan.opaque, format.key[0]);
+        if (depth && depth < best_bits) {
+            choice = GRAY;
+            best_bits = depth;
+            format.has_key = !scan.opaque;
+        }
+    }
+
+    // Gray levels with alpha that neither a bit depth nor a color key can
+    // carry still take half the bytes of RGBA.
+    if (choice == KEEP && channels == 4 && scan.gray) {
+        choice = GRAY_ALPHA;
+        best_bits = 16;
+    }
+
+    if (choice == KEEP && channels == 4 && scan.binary_alpha) {
+        if (scan.opaque || rgb_key(data, width, height, buf_type, format.key)) {
+            choice = RGB;
+            best_bits = 24;
+            format.has_key = !scan.opaque;
+        }
+    }
+
+    // An indexed image wins only if it takes fewer bits per pixel, as it
+    // also needs a PLTE chunk.
+    if (best_bits > 1) {
+        unsigned char *indices = (unsigned char *)malloc(npixels);
+        if (!indices)
+            throw "malloc failed in node-png (reduce_image).";
+        if (exact_quantize(data, width, height, buf_type, 256, format.palette, indices) &&
+            palette_bit_depth(format.palette.ncolors) < best_bits) {
+            format.has_key = false;
+            format.color_type = PNG_COLOR_TYPE_PALETTE;
+            format.bit_depth = palette_bit_depth(format.palette.ncolors);
+            format.row_width = pack_indices(indices, width, height, format.bit_depth);
+            format.rows_type = BUF_GRAY;
+            return indices;
+        }
+        free(indices);
+    }
+
+    switch (choice) {
+    case GRAY:
+        return gray_image(data, width, height, buf_type, depth, format);
+    case GRAY_ALPHA:
+        return gray_alpha_image(data, width, height, format);
+    case RGB:
+        return rgb_image(data, width, height, buf_type, format);
+    default:
+        return NULL;
+    }
+}
+
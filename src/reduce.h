@@ -0,0 +1,44 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include "common.h"
+#include "quantize.h"
+
+// The PNG format of an image that was converted before encoding, instead
+// of the one its buffer_type implies, and the layout of the converted rows:
+// they go through the encode paths like rows of row_width pixels of
+// rows_type (packed samples of less than 8 bits are written as BUF_GRAY
+// rows that many bytes wide).
+struct PngFormat {
+    int color_type;   // PNG_COLOR_TYPE_*
+    int bit_depth;
+    Palette palette;  // for PNG_COLOR_TYPE_PALETTE
+    bool has_key;     // tRNS: pixels of this color are transparent
+    int key[3];       // gray in key[0], or RGB, as samples of bit_depth
+
+    int row_width;
+    buffer_type rows_type;
+
+    PngFormat() : color_type(0), bit_depth(8), has_key(false), row_width(0), rows_type(BUF_GRAY) {
+        key[0] = key[1] = key[2] = 0;
+    }
+};
+
+// Quantizes the image to an indexed one, see quantize(). Returns the packed
+// index rows, to be freed by the caller. Throws const char * on failure.
+unsigned char *palette_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    int max_colors, bool dither, PngFormat &format);
+
+// Looks for a smaller lossless format for the image: without the alpha
+// channel if all pixels are opaque, or with a color key (tRNS) if all
+// transparent pixels have one color no other pixel has; gray if R=G=B, at
+// fewer bits if the gray levels allow it, with a spare level as the key if
+// pixels are either opaque or transparent, or with an alpha channel if
+// not; indexed if there are at most 256 colors. Returns the image converted
+// to the smallest of those, to be freed by the caller, or NULL if
+// buf_type's format is as small as it gets. Throws const char * on failure.
+unsigned char *reduce_image(const unsigned char *data, int width, int height, buffer_type buf_type,
+    PngFormat &format);
+
+#endif
+
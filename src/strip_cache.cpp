@@ -0,0 +1,96 @@
+#include <cstdlib>
+
+#include "strip_cache.h"
+
+// Filtered bytes per strip. Every strip starts deflate over with an empty
+// window, so smaller strips track changes more closely but compress worse.
+static const size_t STRIP_BYTES = 128*1024;
+
+StripCache::StripCache(int height, size_t row_bytes) :
+    strips(NULL), nstrips(0), busy(false), valid(false), level(0), strategy(0), filters(0)
+{
+    strip_rows = STRIP_BYTES / (row_bytes + 1);
+    if (strip_rows < 1)
+        strip_rows = 1;
+    nstrips = height > 0 ? (height + strip_rows - 1) / strip_rows : 0;
+
+    strips = new DeflateStrip[nstrips > 0 ? nstrips : 1];
+    for (int i = 0; i < nstrips; i++) {
+        strips[i].first_row = i * strip_rows;
+        strips[i].nrows = height - strips[i].first_row < strip_rows ?
+            height - strips[i].first_row : strip_rows;
+    }
+    dirty.assign(nstrips, 1);
+    stale.assign(nstrips, 0);
+}
+
+StripCache::~StripCache()
+{
+    delete [] strips;
+}
+
+void
+StripCache::mark_dirty(int y, int h)
+{
+    if (h <= 0 || nstrips == 0)
+        return;
+    int first = y / strip_rows, last = (y + h - 1) / strip_rows;
+    for (int i = first; i <= last && i < nstrips; i++)
+        dirty[i] = 1;
+}
+
+void
+StripCache::mark_all_dirty()
+{
+    dirty.assign(nstrips, 1);
+}
+
+bool
+StripCache::acquire(const EncodeOptions &opts)
+{
+    if (busy || nstrips == 0)
+        return false;
+    if (opts.palette || opts.reduce || opts.backend != BACKEND_ZLIB)
+        return false;
+
+    if (!valid || opts.level != level || opts.strategy != strategy || opts.filters != filters) {
+        mark_all_dirty();
+        level = opts.level;
+        strategy = opts.strategy;
+        filters = opts.filters;
+        valid = true;
+    }
+    stale.swap(dirty);
+    dirty.assign(nstrips, 0);
+    busy = true;
+    return true;
+}
+
+void
+StripCache::release(bool ok)
+{
+    busy = false;
+    stale.assign(nstrips, 0);
+    if (!ok)
+        valid = false;
+}
+
+void
+StripCache::clear()
+{
+    for (int i = 0; i < nstrips; i++) {
+        free(strips[i].out);
+        strips[i].out = NULL;
+        strips[i].out_len = strips[i].mem_len = 0;
+    }
+    valid = false;
+}
+
+size_t
+StripCache::memory() const
+{
+    size_t total = 0;
+    for (int i = 0; i < nstrips; i++)
+        total += strips[i].mem_len;
+    return total;
+}
@@ -0,0 +1,52 @@
+#ifndef STRIP_CACHE_H
+#define STRIP_CACHE_H
+
+#include <vector>
+
+#include "encode_options.h"
+#include "parallel_deflate.h"
+
+// The compressed strips of a canvas that's encoded again and again, kept
+// between encodes so that only strips whose rows changed since the last
+// encode are deflated again. The strips are made standalone (see
+// ParallelDeflate::compress_cached), so a cached strip stays valid whatever
+// happens to the rows around it.
+//
+// mark_dirty(), acquire() and release() are for the main thread. Between
+// acquire() and release() the strips belong to one encode.
+class StripCache {
+    DeflateStrip *strips;
+    int nstrips, strip_rows;
+    std::vector<char> dirty;    // strips changed since the last acquire()
+    std::vector<char> stale;    // strips the current encode deflates
+    bool busy, valid;
+    int level, strategy, filters;  // options the cached strips were made with
+
+public:
+    StripCache(int height, size_t row_bytes);
+    ~StripCache();
+
+    void mark_dirty(int y, int h);
+    void mark_all_dirty();
+
+    // Hands the strips to an encode with opts. Returns false if they can't
+    // be used for it: another encode has them, or opts convert the image or
+    // pick another deflate backend.
+    bool acquire(const EncodeOptions &opts);
+
+    // Takes the strips back. After a failed encode all of them are deflated
+    // again next time.
+    void release(bool ok);
+
+    // Frees the compressed strips.
+    void clear();
+
+    // Bytes of compressed data held.
+    size_t memory() const;
+
+    int count() const { return nstrips; }
+    DeflateStrip *get_strips() { return strips; }
+    bool is_stale(int i) const { return stale[i] != 0; }
+};
+
+#endif
@@ -0,0 +1,55 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+// Every backend node-png was built with must write PNGs that decode to the
+// pixels it was given. Backends that weren't built in are skipped.
+var WIDTH = 640, HEIGHT = 480;
+var rgba = new Buffer(WIDTH * HEIGHT * 4);
+for (var i = 0; i < rgba.length; i++)
+    rgba[i] = ((i * 11) ^ (i >> 10)) & 0xFF;
+var gray = new Buffer(WIDTH * HEIGHT);
+for (var i = 0; i < gray.length; i++)
+    gray[i] = (i >> 6) & 0xFF;
+
+var cases = [
+    { name: 'rgba', type: 'rgba', data: rgba, opts: {} },
+    { name: 'rgba level 9', type: 'rgba', data: rgba, opts: { level: 9, filters: 'all' } },
+    { name: 'gray level 1', type: 'gray', data: gray, opts: { level: 1, filters: 'up' } }
+];
+
+['zlib', 'libdeflate', 'zlib-ng'].forEach(function (backend) {
+    var missing = false;
+    cases.forEach(function (c) {
+        if (missing)
+            return;
+        var opts = { backend: backend };
+        for (var k in c.opts)
+            opts[k] = c.opts[k];
+        var png;
+        try {
+            png = new PngLib.Png(c.data, WIDTH, HEIGHT, c.type).encodeSync(opts);
+        }
+        catch (e) {
+            if (e.message != 'node-png was built without this compression backend.') {
+                console.log("Error: " + backend + " " + c.name + ": " + e.message);
+                process.exit(1);
+            }
+            console.log(backend + ": not built in");
+            missing = true;
+            return;
+        }
+        decode(png, c.type, function (err, img) {
+            if (err) {
+                console.log("Error: " + backend + " " + c.name + ": " + err.message);
+                process.exit(1);
+            }
+            if (firstDifference(img.pixels, c.data) >= 0) {
+                console.log("Error: " + backend + " " + c.name + " decodes to other pixels");
+                process.exit(1);
+            }
+            console.log(backend + " " + c.name + ": " + png.length + " bytes, pixels match");
+        });
+    });
+});
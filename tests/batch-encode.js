@@ -0,0 +1,108 @@
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var files = fs.readdirSync('./push-data');
+var images = files.map(function (file) {
+    var dim = rectDim(file);
+    return {
+        data: fs.readFileSync('./push-data/' + file),
+        width: dim.w,
+        height: dim.h,
+        type: 'rgba'
+    };
+});
+
+var pngs = PngLib.encodeBatchSync(images);
+pngs.forEach(function (png, i) {
+    var single = new PngLib.Png(images[i].data, images[i].width, images[i].height, 'rgba').encodeSync();
+    if (png.toString('binary') != single.toString('binary')) {
+        console.log("Error: batch result " + i + " differs from Png.encodeSync");
+        process.exit(1);
+    }
+});
+console.log("encodeBatchSync: " + pngs.length + " images");
+
+var inBytes = 0;
+images.forEach(function (img) {
+    inBytes += img.data.length;
+});
+
+// Each image counts as one encode, timed by its own encode, so the totals
+// are at most the batch's time on each of its threads.
+function checkStats(name, start, nthreads) {
+    var t = process.hrtime(start);
+    var elapsed = t[0] * 1e3 + t[1] / 1e6;
+    var s = PngLib.encoderStats();
+    if (s.encodes != images.length || s.inBytes != inBytes || s.total > elapsed * nthreads) {
+        console.log("Error: " + name + " stats: " + s.encodes + " encodes, " + s.inBytes +
+            " bytes in, " + s.total.toFixed(2) + " ms total in " + elapsed.toFixed(2) + " ms");
+        process.exit(1);
+    }
+    console.log(name + " stats: " + s.encodes + " encodes, " + s.total.toFixed(2) + " ms total");
+}
+
+PngLib.resetEncoderStats();
+var syncStart = process.hrtime();
+PngLib.encodeBatchSync(images, { parallel: 1 });
+checkStats('encodeBatchSync', syncStart, 1);
+
+PngLib.resetEncoderStats();
+var asyncStart = process.hrtime();
+PngLib.encodeBatch(images, { level: 9, parallel: 2 }, function (pngs, error, stats) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    checkStats('encodeBatch', asyncStart, 2);
+    if (stats.length != images.length) {
+        console.log("Error: " + stats.length + " stats for " + images.length + " images");
+        process.exit(1);
+    }
+    pngs.forEach(function (png, i) {
+        fs.writeFileSync('batch-' + files[i].replace('.dat', '.png'), png.toString('binary'), 'binary');
+    });
+    console.log("encodeBatch: " + pngs.length + " images");
+
+    // The batch holds on to the Buffers it was given rather than to the
+    // images, so replacing them before it calls back doesn't free the
+    // pixels it's reading. Run with --expose-gc to have them collected.
+    var copies = images.map(function (img) {
+        return { data: new Buffer(img.data), width: img.width, height: img.height, type: 'rgba' };
+    });
+    PngLib.encodeBatch(copies, { level: 9 }, function (again, error) {
+        if (error) {
+            console.log("Error: " + error);
+            process.exit(1);
+        }
+        again.forEach(function (png, i) {
+            if (png.toString('binary') != pngs[i].toString('binary')) {
+                console.log("Error: batch result " + i + " changed when its Buffer was replaced");
+                process.exit(1);
+            }
+        });
+        console.log("encodeBatch with replaced Buffers: " + again.length + " images");
+    });
+    copies.forEach(function (img) {
+        img.data = new Buffer(0);
+    });
+    copies[0] = {};
+    if (global.gc)
+        gc();
+});
+
+try {
+    PngLib.encodeBatchSync([images[0], { data: images[1].data, width: 1000, height: 1000 }]);
+    console.log("Error: a too small Buffer was accepted");
+    process.exit(1);
+}
+catch (e) {
+    console.log("too small Buffer rejected: " + e.message);
+}
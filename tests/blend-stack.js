@@ -0,0 +1,111 @@
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+var child_process = require('child_process');
+var decode = require('./png-decode').decode;
+
+var WIDTH = 200, HEIGHT = 100;
+
+// Alpha is inverted: 0 is opaque, 255 transparent.
+function solid(w, h, r, g, b, a) {
+    var buf = new Buffer(w * h * 4);
+    for (var i = 0; i < buf.length; i += 4) {
+        buf[i] = r; buf[i + 1] = g; buf[i + 2] = b; buf[i + 3] = a;
+    }
+    return buf;
+}
+
+// A horizontal gradient from opaque to transparent, premultiplied.
+function gradient(w, h) {
+    var buf = new Buffer(w * h * 4);
+    for (var y = 0; y < h; y++) {
+        for (var x = 0; x < w; x++) {
+            var i = (y * w + x) * 4, a = Math.round(255 * x / (w - 1));
+            buf[i] = Math.round(255 * (255 - a) / 255);
+            buf[i + 1] = 0; buf[i + 2] = 0; buf[i + 3] = a;
+        }
+    }
+    return buf;
+}
+
+function pushAll(stack, copy) {
+    stack.push(solid(WIDTH, HEIGHT, 0, 0, 255, 0), 0, 0, WIDTH, HEIGHT, { blend: 'none' });
+    stack.push(solid(100, 50, 255, 255, 255, 128), 20, 20, 100, 50);
+    stack.push(gradient(150, 40), 40, 50, 150, 40, { copy: copy, blend: 'over-premultiplied' });
+}
+
+var fixed = new PngLib.FixedPngStack(WIDTH, HEIGHT, 'rgba', { blend: 'over' });
+pushAll(fixed);
+var f = fixed.encodeSync();
+fs.writeFileSync('blend-fixed.png', f.toString('binary'), 'binary');
+console.log("fixed: " + f.length + " bytes");
+
+// Blending the same pushes when a DynamicPngStack is encoded gives the same
+// PNG.
+var dynamic = new PngLib.DynamicPngStack('rgba', { blend: 'over' });
+pushAll(dynamic, false);
+var d = dynamic.encodeSync();
+if (d.toString('binary') != f.toString('binary')) {
+    console.log("Error: DynamicPngStack blended differently");
+    process.exit(1);
+}
+
+// Both stacks blend with the same kernels, so check the source-over math
+// itself on a few pixels, as [r, g, b, inverted alpha]:
+var expected = [
+    // opaque blue, under nothing
+    { x: 5, y: 5, rgba: [0, 0, 255, 0] },
+    // 'over': 50% white over the blue
+    { x: 30, y: 30, rgba: [127, 127, 255, 0] },
+    // 'over-premultiplied': gradient at 50% (127, 0, 0) over the above
+    { x: 115, y: 60, rgba: [191, 64, 128, 0] },
+    // the same further along, at 26% (67, 0, 0) over the blue
+    { x: 150, y: 60, rgba: [67, 0, 188, 0] }
+];
+decode(f, 'rgba', function (err, img) {
+    if (err) {
+        console.log("Error: " + err.message);
+        process.exit(1);
+    }
+    expected.forEach(function (e) {
+        var i = (e.y * img.width + e.x) * 4;
+        var got = [img.pixels[i], img.pixels[i + 1], img.pixels[i + 2], img.pixels[i + 3]];
+        if (got.join() != e.rgba.join()) {
+            console.log("Error: pixel (" + e.x + "," + e.y + ") is " + got.join() +
+                ", expected " + e.rgba.join());
+            process.exit(1);
+        }
+    });
+    console.log(expected.length + " blended pixels as expected");
+});
+
+// The vector kernels and the plain loops (NODE_PNG_KERNELS=plain) must
+// blend to the same PNG.
+if (process.env.NODE_PNG_KERNELS == 'plain') {
+    console.log("plain: " + f.toString('hex'));
+}
+else {
+    var env = {};
+    for (var k in process.env)
+        env[k] = process.env[k];
+    env.NODE_PNG_KERNELS = 'plain';
+    child_process.execFile(process.execPath, [__filename], { env: env }, function (err, stdout) {
+        if (err)
+            throw err;
+        var m = stdout.match(/^plain: (\w+)$/m);
+        if (!m || m[1] != f.toString('hex')) {
+            console.log("Error: the kernels and the plain loops blended differently");
+            process.exit(1);
+        }
+        console.log("same PNG with and without the kernels");
+    });
+}
+
+try {
+    fixed.push(solid(1, 1, 0, 0, 0, 0), 0, 0, 1, 1, { blend: 'multiply' });
+    console.log("Error: blend 'multiply' was accepted");
+    process.exit(1);
+}
+catch (e) {
+    console.log("blend 'multiply' rejected: " + e.message);
+}
@@ -0,0 +1,60 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+
+var WIDTH = 2000, HEIGHT = 2000;
+var buf = new Buffer(WIDTH * HEIGHT * 4);
+for (var i = 0; i < buf.length; i++)
+    buf[i] = (i * 7) ^ (i >> 9);
+
+// One thread, so all but the first encode are still queued when they're
+// cancelled.
+var ENCODES = 6;
+PngLib.setEncoderThreads(1);
+PngLib.setMaxPendingEncodes(ENCODES);
+
+var done = 0, cancelled = 0, handles = [];
+for (var n = 0; n < ENCODES; n++) {
+    var png = new PngLib.Png(buf, WIDTH, HEIGHT, 'rgba');
+    handles.push(png.encode({ level: 9 }, function (data, error) {
+        if (error) {
+            if (error.message != 'Encode cancelled.') {
+                console.log("Error: " + error);
+                process.exit(1);
+            }
+            cancelled++;
+        }
+        if (++done < ENCODES)
+            return;
+        if (cancelled < ENCODES - 1 || (cancelled != dropped && cancelled != dropped + 1)) {
+            console.log("Error: " + cancelled + " of " + ENCODES + " encodes cancelled, " +
+                dropped + " dropped before they started");
+            process.exit(1);
+        }
+        if (PngLib.pendingEncodes() != 0) {
+            console.log("Error: " + PngLib.pendingEncodes() + " encodes still pending");
+            process.exit(1);
+        }
+        console.log(cancelled + " of " + ENCODES + " encodes cancelled, " + dropped +
+            " of them before they started");
+    }));
+}
+
+if (PngLib.pendingEncodes() != ENCODES) {
+    console.log("Error: " + PngLib.pendingEncodes() + " encodes pending, expected " + ENCODES);
+    process.exit(1);
+}
+
+try {
+    new PngLib.Png(buf, WIDTH, HEIGHT, 'rgba').encode(function () {});
+    console.log("Error: an encode past setMaxPendingEncodes was queued");
+    process.exit(1);
+}
+catch (e) {
+    console.log("encode past the limit refused: " + e.message);
+}
+
+var dropped = 0;
+handles.forEach(function (handle) {
+    if (PngLib.cancelEncode(handle))
+        dropped++;
+});
@@ -0,0 +1,59 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+// Encodes of different sizes and types one after the other and at the same
+// time, so that pooled libpng memory is reused by encodes that don't look
+// like the one that allocated it. The PNGs must be the same as with a fresh
+// context every time, and decode to their pixels.
+var CHANNELS = { rgb: 3, bgr: 3, rgba: 4, bgra: 4, gray: 1, graya: 2 };
+var images = [];
+['rgba', 'gray', 'bgr', 'graya', 'rgb', 'bgra'].forEach(function (type, n) {
+    var width = 50 + n * 97, height = 30 + n * 41;
+    var buf = new Buffer(width * height * CHANNELS[type]);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = ((i * (n + 3)) ^ (i >> 7)) & 0xFF;
+    images.push({ type: type, width: width, height: height, data: buf });
+});
+
+function check(name, img, png, fresh) {
+    if (png.toString('binary') != fresh.toString('binary')) {
+        console.log("Error: " + name + " differs from an encode with a fresh context");
+        process.exit(1);
+    }
+    decode(png, img.type, function (err, dec) {
+        if (err) {
+            console.log("Error: " + name + ": " + err.message);
+            process.exit(1);
+        }
+        if (firstDifference(dec.pixels, img.data) >= 0) {
+            console.log("Error: " + name + " decodes to other pixels");
+            process.exit(1);
+        }
+        console.log(name + ": " + png.length + " bytes, pixels match");
+    });
+}
+
+var fresh = images.map(function (img) {
+    var png = new PngLib.Png(img.data, img.width, img.height, img.type);
+    return png.encodeSync({ reuseContext: false });
+});
+
+for (var round = 0; round < 2; round++) {
+    images.forEach(function (img, i) {
+        var png = new PngLib.Png(img.data, img.width, img.height, img.type);
+        check('sync ' + img.type + ' round ' + round, img, png.encodeSync(), fresh[i]);
+    });
+}
+
+images.forEach(function (img, i) {
+    var png = new PngLib.Png(img.data, img.width, img.height, img.type);
+    png.encode(function (data, error) {
+        if (error) {
+            console.log("Error: " + error);
+            process.exit(1);
+        }
+        check('async ' + img.type, img, data, fresh[i]);
+    });
+});
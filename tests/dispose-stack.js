@@ -0,0 +1,45 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+
+var buf = new Buffer(100 * 100 * 4);
+for (var i = 0; i < buf.length; i++)
+    buf[i] = i & 0xFF;
+
+function expectThrow(what, fn) {
+    try {
+        fn();
+    }
+    catch (e) {
+        console.log(what + ": " + e.message);
+        return;
+    }
+    console.log("Error: " + what + " didn't throw");
+    process.exit(1);
+}
+
+var dynamic = new PngLib.DynamicPngStack('rgba');
+dynamic.push(buf, 0, 0, 100, 100);
+dynamic.reset();
+dynamic.push(buf, 10, 10, 50, 50);
+dynamic.encodeSync();
+console.log("dynamic after reset: " + JSON.stringify(dynamic.dimensions()));
+
+var fixed = new PngLib.FixedPngStack(100, 100, 'rgba');
+fixed.push(buf, 0, 0, 100, 100);
+
+// The encode still gets the canvas, dispose only frees it afterwards.
+fixed.encode(function (png, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    console.log("encode before dispose: " + png.length + " bytes");
+    expectThrow("encodeSync after dispose", function () { fixed.encodeSync(); });
+});
+expectThrow("reset while encoding", function () { fixed.reset(); });
+fixed.dispose();
+fixed.dispose();
+expectThrow("push after dispose", function () { fixed.push(buf, 0, 0, 10, 10); });
+
+dynamic.dispose();
+expectThrow("dynamic push after dispose", function () { dynamic.push(buf, 0, 0, 10, 10); });
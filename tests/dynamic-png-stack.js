@@ -27,3 +27,102 @@ var dims = pngStack.dimensions();
 console.log("PNG located at (" + dims.x + "," + dims.y + ") with width " +
     dims.width + " and height " + dims.height);
 
+
+// The same pushes by reference encode to the same PNG.
+var refStack = new PngLib.DynamicPngStack('rgba', { copy: false });
+files.forEach(function(file) {
+    var dim = rectDim(file);
+    refStack.push(fs.readFileSync('./push-data/' + file), dim.x, dim.y, dim.w, dim.h);
+});
+if (refStack.encodeSync().toString('binary') != fs.readFileSync('dynamic.png', 'binary')) {
+    console.log("Error: pushes with copy: false encoded differently");
+    process.exit(1);
+}
+
+// Composing 64 rows at a time gives the same PNG as composing the whole
+// image first, which threads: 2 does (the image is too small for more than
+// one strip).
+if (pngStack.encodeSync({ threads: 2 }).toString('binary') != fs.readFileSync('dynamic.png', 'binary')) {
+    console.log("Error: the streamed and whole-image encodes differ");
+    process.exit(1);
+}
+
+// Two fragments far apart. threads: 4 deflates the whole image in strips,
+// so compare pixels rather than bytes.
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+function fragment(seed) {
+    var buf = new Buffer(64 * 64 * 4);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = (i * seed) & 0xFF;
+    return buf;
+}
+
+var sparse = new PngLib.DynamicPngStack('rgba');
+var frags = [{ buf: fragment(7), x: 0, y: 0 }, { buf: fragment(13), x: 1500, y: 1200 }];
+frags.forEach(function (f) {
+    sparse.push(f.buf, f.x, f.y, 64, 64);
+});
+var streamed = sparse.encodeSync();
+var composed = sparse.encodeSync({ threads: 4 });
+
+decode(streamed, 'rgba', function (err, a) {
+    if (err) {
+        console.log("Error: " + err.message);
+        process.exit(1);
+    }
+    decode(composed, 'rgba', function (err, b) {
+        if (err) {
+            console.log("Error: " + err.message);
+            process.exit(1);
+        }
+        if (firstDifference(a.pixels, b.pixels) >= 0) {
+            console.log("Error: the streamed and whole-image encodes decode differently");
+            process.exit(1);
+        }
+        frags.forEach(function (f) {
+            for (var y = 0; y < 64; y++) {
+                var row = a.pixels.slice(((f.y + y) * a.width + f.x) * 4, ((f.y + y) * a.width + f.x + 64) * 4);
+                if (firstDifference(row, f.buf.slice(y * 256, (y + 1) * 256)) >= 0) {
+                    console.log("Error: the fragment at (" + f.x + "," + f.y + ") decodes to other pixels");
+                    process.exit(1);
+                }
+            }
+        });
+        console.log("sparse " + a.width + "x" + a.height + ": " + streamed.length +
+            " bytes streamed, pixels match");
+    });
+});
+
+// An encode composes rows from the pushes it started with while it runs, so
+// pushes are refused until it calls back. Each encode reports its own
+// dimensions.
+var busy = new PngLib.DynamicPngStack('rgba');
+busy.push(fragment(7), 0, 0, 64, 64);
+busy.encode(function (png, dims, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    if (dims.width != 64 || dims.height != 64) {
+        console.log("Error: encode of one push reported " + dims.width + "x" + dims.height);
+        process.exit(1);
+    }
+    busy.push(fragment(13), 100, 100, 64, 64);
+    busy.encodeSync();
+    var after = busy.dimensions();
+    if (after.width != 164 || after.height != 164) {
+        console.log("Error: encode after a push reported " + after.width + "x" + after.height);
+        process.exit(1);
+    }
+    console.log("push after the encode called back: " + after.width + "x" + after.height);
+});
+try {
+    busy.push(fragment(13), 100, 100, 64, 64);
+    console.log("Error: a push during an encode was accepted");
+    process.exit(1);
+}
+catch (e) {
+    console.log("push during an encode refused: " + e.message);
+}
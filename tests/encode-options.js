@@ -0,0 +1,50 @@
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var pngStack = new PngLib.FixedPngStack(720, 400, 'rgba', { level: 1, filters: 'up' });
+
+var files = fs.readdirSync('./push-data');
+
+files.forEach(function(file) {
+    var dim = rectDim(file);
+    var rgba = fs.readFileSync('./push-data/' + file);
+    pngStack.push(rgba, dim.x, dim.y, dim.w, dim.h);
+});
+
+var fast = pngStack.encodeSync();
+var small = pngStack.encodeSync({ level: 9, filters: 'all' });
+var rle = pngStack.encodeSync({ strategy: 'rle', filters: ['sub', 'up'] });
+
+fs.writeFileSync('options-fast.png', fast.toString('binary'), 'binary');
+fs.writeFileSync('options-small.png', small.toString('binary'), 'binary');
+fs.writeFileSync('options-rle.png', rle.toString('binary'), 'binary');
+
+console.log("fast: " + fast.length + " bytes, small: " + small.length +
+    " bytes, rle: " + rle.length + " bytes");
+
+pngStack.encode({ level: 0 }, function (data, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    console.log("stored: " + data.length + " bytes");
+});
+
+try {
+    pngStack.encodeSync({ level: 10 });
+    console.log("Error: level 10 was accepted");
+    process.exit(1);
+}
+catch (e) {
+    console.log("level 10 rejected: " + e.message);
+}
+
@@ -0,0 +1,45 @@
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+
+var WIDTH = 720, HEIGHT = 400;
+
+function fill(w, h, channels, value) {
+    var buf = new Buffer(w * h * channels);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = (value + i) & 0xFF;
+    return buf;
+}
+
+['rgb', 'gray', 'graya'].forEach(function (type) {
+    var channels = { rgb: 3, gray: 1, graya: 2 }[type];
+    var alpha = new PngLib.FixedPngStack(WIDTH, HEIGHT, type);
+    var native = new PngLib.FixedPngStack(WIDTH, HEIGHT, type, { canvas: 'native' });
+
+    [[0, 0, 360, 200], [360, 200, 360, 200], [100, 50, 200, 300]].forEach(function (r, i) {
+        var buf = fill(r[2], r[3], channels, i * 50);
+        alpha.push(buf, r[0], r[1], r[2], r[3]);
+        native.push(buf, r[0], r[1], r[2], r[3]);
+    });
+
+    var a = alpha.encodeSync(), n = native.encodeSync();
+    fs.writeFileSync('canvas-' + type + '-alpha.png', a.toString('binary'), 'binary');
+    fs.writeFileSync('canvas-' + type + '-native.png', n.toString('binary'), 'binary');
+    console.log(type + ": alpha canvas " + a.length + " bytes, native canvas " + n.length + " bytes");
+
+    var dynamic = new PngLib.DynamicPngStack(type, { canvas: 'native' });
+    dynamic.push(fill(64, 64, channels, 7), 10, 20, 64, 64);
+    dynamic.push(fill(32, 32, channels, 9), 60, 70, 32, 32);
+    var d = dynamic.encodeSync();
+    var dims = dynamic.dimensions();
+    console.log(type + ": dynamic " + dims.width + "x" + dims.height + ", " + d.length + " bytes");
+});
+
+try {
+    new PngLib.FixedPngStack(10, 10, 'rgb', { canvas: 'planar' });
+    console.log("Error: canvas 'planar' was accepted");
+    process.exit(1);
+}
+catch (e) {
+    console.log("canvas 'planar' rejected: " + e.message);
+}
@@ -0,0 +1,78 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+function fail(msg) {
+    console.log("Error: " + msg);
+    process.exit(1);
+}
+
+// An image of ncolors colors, some of them translucent and one fully
+// transparent (as black, which is what the palette makes of any fully
+// transparent pixel).
+function image(width, height, type, ncolors) {
+    var bgr = type == 'bgra';
+    var buf = new Buffer(width * height * 4);
+    for (var i = 0; i < width * height; i++) {
+        var k = (Math.floor(i / 7) + i % 5) % ncolors;
+        var r = k * 37 & 0xFF, g = k * 11 & 0xFF, b = 255 - k;
+        var a = k == 3 ? 255 : k % 4 == 1 ? 100 : 0;
+        if (a == 255)
+            r = g = b = 0;
+        buf[i*4] = bgr ? b : r;
+        buf[i*4 + 1] = g;
+        buf[i*4 + 2] = bgr ? r : b;
+        buf[i*4 + 3] = a;
+    }
+    return buf;
+}
+
+// Images with at most 'colors' colors keep them exactly, at the bit depth
+// their count needs.
+[[2, 1], [4, 2], [12, 4], [200, 8]].forEach(function (c) {
+    var ncolors = c[0], depth = c[1];
+    ['rgba', 'bgra'].forEach(function (type) {
+        var buf = image(97, 61, type, ncolors);
+        var png = new PngLib.Png(buf, 97, 61, type).encodeSync({ palette: true });
+        decode(png, type, function (err, img) {
+            if (err)
+                fail(ncolors + " colors " + type + ": " + err.message);
+            if (img.colorType != 3 || img.depth != depth)
+                fail(ncolors + " colors " + type + ": color type " + img.colorType + " depth " + img.depth);
+            if (firstDifference(img.pixels, buf) >= 0)
+                fail(ncolors + " colors " + type + " decodes to other pixels");
+            console.log(ncolors + " colors " + type + ": " + png.length + " bytes, " +
+                depth + " bit, pixels match");
+        });
+    });
+});
+
+// Quantized images have no more colors than asked for.
+var WIDTH = 256, HEIGHT = 256;
+var photo = new Buffer(WIDTH * HEIGHT * 3);
+for (var i = 0; i < WIDTH * HEIGHT; i++) {
+    photo[i*3] = i & 0xFF;
+    photo[i*3 + 1] = (i >> 8) & 0xFF;
+    photo[i*3 + 2] = ((i & 0xFF) + (i >> 8)) >> 1;
+}
+[{ colors: 16 }, { colors: 64, dither: true }].forEach(function (opts) {
+    opts.palette = true;
+    var png = new PngLib.Png(photo, WIDTH, HEIGHT, 'rgb').encodeSync(opts);
+    decode(png, 'rgb', function (err, img) {
+        if (err)
+            fail(opts.colors + " colors: " + err.message);
+        var seen = {}, n = 0;
+        for (var i = 0; i < WIDTH * HEIGHT; i++) {
+            var key = img.pixels.toString('hex', i*3, i*3 + 3);
+            if (!seen[key]) {
+                seen[key] = true;
+                n++;
+            }
+        }
+        if (img.colorType != 3 || n > opts.colors)
+            fail(opts.colors + " colors: decoded to " + n + " colors");
+        console.log(opts.colors + " colors" + (opts.dither ? ", dithered" : "") + ": " +
+            png.length + " bytes, " + n + " colors");
+    });
+});
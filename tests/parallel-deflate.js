@@ -0,0 +1,40 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+// 4MB of pixels, enough for a strip per thread.
+var WIDTH = 1000, HEIGHT = 1000;
+var buf = new Buffer(WIDTH * HEIGHT * 4);
+for (var i = 0; i < buf.length; i++)
+    buf[i] = (i % 4 == 3) ? (i >> 12) & 0xFF : ((i * 7) ^ (i >> 11)) & 0xFF;
+
+var png = new PngLib.Png(buf, WIDTH, HEIGHT, 'rgba');
+
+function check(name, data) {
+    decode(data, 'rgba', function (err, img) {
+        if (err) {
+            console.log("Error: " + name + ": " + err.message);
+            process.exit(1);
+        }
+        var i = firstDifference(img.pixels, buf);
+        if (i >= 0) {
+            console.log("Error: " + name + " decodes to other pixels, from byte " + i);
+            process.exit(1);
+        }
+        console.log(name + ": " + data.length + " bytes, pixels match");
+    });
+}
+
+check('threads 1', png.encodeSync({ threads: 1 }));
+check('threads 4', png.encodeSync({ threads: 4 }));
+check('threads 4, paeth', png.encodeSync({ threads: 4, filters: 'paeth' }));
+check('threads 3, level 9', png.encodeSync({ threads: 3, level: 9, filters: 'all' }));
+
+png.encode({ threads: 4 }, function (data, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    check('async threads 4', data);
+});
@@ -0,0 +1,35 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+
+var WIDTH = 1000, HEIGHT = 1000;
+var buf = new Buffer(WIDTH * HEIGHT * 4);
+for (var i = 0; i < buf.length; i++)
+    buf[i] = (i * 7) ^ (i >> 9);
+
+var png = new PngLib.Png(buf, WIDTH, HEIGHT, 'rgba');
+var expected = png.encodeSync();
+
+png.encode({ pin: 'copy' }, function (data, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    if (data.toString('binary') != expected.toString('binary')) {
+        console.log("Error: the copy saw the buffer change");
+        process.exit(1);
+    }
+    console.log("copy: unaffected by the change");
+
+    // Keeps writing to the buffer while it's encoded.
+    var writing = true;
+    (function write() {
+        buf[(Math.random() * buf.length) | 0]++;
+        if (writing)
+            setImmediate(write);
+    })();
+    png.encode({ pin: 'check', level: 9 }, function (data, error) {
+        writing = false;
+        console.log("check: " + (error ? error.message : "no change seen"));
+    });
+});
+buf.fill(0);
@@ -0,0 +1,65 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var child_process = require('child_process');
+
+// Encodes every buffer type through pushes and the encoders, and prints an
+// adler-like sum of each PNG. The vector kernels and the plain loops
+// (NODE_PNG_KERNELS=plain) must give the same PNGs.
+var WIDTH = 301, HEIGHT = 77;
+var types = { rgb: 3, bgr: 3, rgba: 4, bgra: 4, gray: 1, graya: 2 };
+
+function fill(w, h, channels, seed) {
+    var buf = new Buffer(w * h * channels);
+    for (var i = 0; i < buf.length; i++) {
+        seed = (seed * 1103515245 + 12345) & 0x7FFFFFFF;
+        buf[i] = (i % 7 == 0) ? seed >> 16 : (i * 13) & 0xFF;
+    }
+    return buf;
+}
+
+function sum(buf) {
+    var a = 1, b = 0;
+    for (var i = 0; i < buf.length; i++) {
+        a = (a + buf[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return buf.length + ':' + b + ':' + a;
+}
+
+var sums = [];
+Object.keys(types).forEach(function (type) {
+    var channels = types[type];
+    var buf = fill(WIDTH, HEIGHT, channels, channels);
+
+    sums.push(sum(new PngLib.Png(buf, WIDTH, HEIGHT, type).encodeSync()));
+    sums.push(sum(new PngLib.Png(buf, WIDTH, HEIGHT, type).encodeSync({ threads: 3 })));
+    sums.push(sum(new PngLib.Png(buf, WIDTH, HEIGHT, type).encodeSync({ reduce: true })));
+
+    var fixed = new PngLib.FixedPngStack(WIDTH + 20, HEIGHT + 20, type);
+    fixed.push(buf, 10, 10, WIDTH, HEIGHT);
+    sums.push(sum(fixed.encodeSync()));
+
+    var dynamic = new PngLib.DynamicPngStack(type);
+    dynamic.push(buf, 5, 5, WIDTH, HEIGHT);
+    dynamic.push(fill(40, 30, channels, 9), 0, 50, 40, 30);
+    sums.push(sum(dynamic.encodeSync()));
+});
+
+if (process.env.NODE_PNG_KERNELS == 'plain') {
+    console.log(JSON.stringify(sums));
+}
+else {
+    var env = {};
+    for (var k in process.env)
+        env[k] = process.env[k];
+    env.NODE_PNG_KERNELS = 'plain';
+    child_process.execFile(process.execPath, [__filename], { env: env }, function (err, stdout) {
+        if (err)
+            throw err;
+        if (stdout.trim() != JSON.stringify(sums)) {
+            console.log("Error: the kernels and the plain loops encoded differently");
+            process.exit(1);
+        }
+        console.log(sums.length + " PNGs the same with and without the kernels");
+    });
+}
@@ -0,0 +1,160 @@
+// A small PNG decoder for the tests that check pixels. It reads the PNGs
+// node-png writes: not interlaced, 8 bits per sample or fewer, any color
+// type, with PLTE and tRNS.
+var zlib = require('zlib');
+var Buffer = require('buffer').Buffer;
+
+var CHANNELS = { 0: 1, 2: 3, 3: 1, 4: 2, 6: 4 };
+
+function paeth(a, b, c) {
+    var p = a + b - c;
+    var pa = Math.abs(p - a), pb = Math.abs(p - b), pc = Math.abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// Undoes the row filters, returning the rows without their filter bytes.
+function unfilter(data, height, stride, bpp) {
+    var out = new Buffer(height * stride);
+    for (var y = 0; y < height; y++) {
+        var filter = data[y * (stride + 1)];
+        var src = y * (stride + 1) + 1, dst = y * stride;
+        for (var x = 0; x < stride; x++) {
+            var a = x >= bpp ? out[dst + x - bpp] : 0;
+            var b = y ? out[dst + x - stride] : 0;
+            var c = x >= bpp && y ? out[dst + x - stride - bpp] : 0;
+            var v = data[src + x];
+            switch (filter) {
+            case 0: break;
+            case 1: v += a; break;
+            case 2: v += b; break;
+            case 3: v += (a + b) >> 1; break;
+            case 4: v += paeth(a, b, c); break;
+            default: throw new Error('bad filter type ' + filter + ' in row ' + y);
+            }
+            out[dst + x] = v & 0xFF;
+        }
+    }
+    return out;
+}
+
+// Sample i of a row of depth bit samples.
+function sample(rows, offset, i, depth) {
+    if (depth == 8)
+        return rows[offset + i];
+    var bit = i * depth;
+    return (rows[offset + (bit >> 3)] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+// RGBA with PNG's alpha, 255 being opaque.
+function toRGBA(png, rows) {
+    var w = png.width, h = png.height, depth = png.depth, ct = png.colorType;
+    var channels = CHANNELS[ct];
+    var stride = Math.ceil(w * channels * depth / 8);
+    var scale = ct == 3 ? 1 : 255 / ((1 << depth) - 1);
+    var out = new Buffer(w * h * 4);
+
+    for (var y = 0; y < h; y++) {
+        for (var x = 0; x < w; x++) {
+            var s = [];
+            for (var c = 0; c < channels; c++)
+                s.push(sample(rows, y * stride, x * channels + c, depth));
+            var r, g, b, a = 255;
+            if (ct == 3) {
+                var i = s[0] * 3;
+                r = png.plte[i]; g = png.plte[i + 1]; b = png.plte[i + 2];
+                if (png.trns && s[0] < png.trns.length)
+                    a = png.trns[s[0]];
+            }
+            else if (ct == 0 || ct == 4) {
+                r = g = b = s[0] * scale;
+                if (ct == 4)
+                    a = s[1];
+                else if (png.trns && png.trns.readUInt16BE(0) == s[0])
+                    a = 0;
+            }
+            else {
+                r = s[0]; g = s[1]; b = s[2];
+                if (ct == 6)
+                    a = s[3];
+                else if (png.trns && png.trns.readUInt16BE(0) == r &&
+                         png.trns.readUInt16BE(2) == g && png.trns.readUInt16BE(4) == b)
+                    a = 0;
+            }
+            var o = (y * w + x) * 4;
+            out[o] = r; out[o + 1] = g; out[o + 2] = b; out[o + 3] = a;
+        }
+    }
+    return out;
+}
+
+// Converts RGBA from toRGBA() to a node-png buffer of type: channels in its
+// order, alpha inverted.
+function toBufferType(rgba, type) {
+    var order = {
+        rgb: [0, 1, 2], bgr: [2, 1, 0], rgba: [0, 1, 2, 3], bgra: [2, 1, 0, 3],
+        gray: [0], graya: [0, 3]
+    }[type];
+    var npixels = rgba.length / 4;
+    var out = new Buffer(npixels * order.length);
+    for (var i = 0; i < npixels; i++) {
+        for (var c = 0; c < order.length; c++) {
+            var v = rgba[i * 4 + order[c]];
+            out[i * order.length + c] = order[c] == 3 ? 255 - v : v;
+        }
+    }
+    return out;
+}
+
+// Calls back with (error, image), image having width, height, colorType,
+// depth and pixels, the pixels as a node-png buffer of type.
+exports.decode = function (data, type, callback) {
+    var png = {}, idat = [];
+    var pos = 8;
+    while (pos < data.length) {
+        var len = data.readUInt32BE(pos);
+        var name = data.toString('ascii', pos + 4, pos + 8);
+        var body = data.slice(pos + 8, pos + 8 + len);
+        if (name == 'IHDR') {
+            png.width = body.readUInt32BE(0);
+            png.height = body.readUInt32BE(4);
+            png.depth = body[8];
+            png.colorType = body[9];
+            png.interlace = body[12];
+        }
+        else if (name == 'PLTE')
+            png.plte = body;
+        else if (name == 'tRNS')
+            png.trns = body;
+        else if (name == 'IDAT')
+            idat.push(body);
+        pos += 12 + len;
+    }
+    if (png.depth > 8 || png.interlace)
+        return callback(new Error('unsupported PNG'));
+
+    zlib.inflate(Buffer.concat(idat), function (err, raw) {
+        if (err)
+            return callback(err);
+        var channels = CHANNELS[png.colorType];
+        var stride = Math.ceil(png.width * channels * png.depth / 8);
+        var bpp = Math.max(1, channels * png.depth / 8);
+        if (raw.length != png.height * (stride + 1))
+            return callback(new Error('IDAT holds ' + raw.length + ' bytes, expected ' +
+                png.height * (stride + 1)));
+        var rows = unfilter(raw, png.height, stride, bpp);
+        png.pixels = toBufferType(toRGBA(png, rows), type);
+        callback(null, png);
+    });
+};
+
+// Index of the first byte where a and b differ, or -1.
+exports.firstDifference = function (a, b) {
+    var n = Math.min(a.length, b.length);
+    for (var i = 0; i < n; i++) {
+        if (a[i] != b[i])
+            return i;
+    }
+    return a.length == b.length ? -1 : n;
+};
@@ -0,0 +1,78 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+var WIDTH = 200, HEIGHT = 150;
+
+// Fills a buffer of type with pixel(i), which returns [r, g, b, alpha].
+function image(type, pixel) {
+    var channels = { rgb: 3, rgba: 4, bgra: 4, gray: 1, graya: 2 }[type];
+    var buf = new Buffer(WIDTH * HEIGHT * channels);
+    for (var i = 0; i < WIDTH * HEIGHT; i++) {
+        var p = pixel(i), o = i * channels;
+        if (type == 'gray' || type == 'graya') {
+            buf[o] = p[0];
+            if (channels == 2)
+                buf[o + 1] = p[3];
+            continue;
+        }
+        buf[o] = type == 'bgra' ? p[2] : p[0];
+        buf[o + 1] = p[1];
+        buf[o + 2] = type == 'bgra' ? p[0] : p[2];
+        if (channels == 4)
+            buf[o + 3] = p[3];
+    }
+    return buf;
+}
+
+// Many colors, so that an indexed image isn't the smallest.
+function color(i) {
+    return [i & 0xFF, (i >> 3) & 0xFF, (i * 5) & 0xFF];
+}
+
+var cases = [
+    { name: 'opaque rgba', type: 'rgba', colorType: 2, depth: 8,
+      pixel: function (i) { return color(i).concat(0); } },
+    { name: 'opaque gray in bgra', type: 'bgra', colorType: 0, depth: 2,
+      pixel: function (i) { var v = (i % 4) * 85; return [v, v, v, 0]; } },
+    { name: 'gray in rgb', type: 'rgb', colorType: 0, depth: 8,
+      pixel: function (i) { var v = i & 0xFF; return [v, v, v, 0]; } },
+    { name: 'few colors rgb', type: 'rgb', colorType: 3, depth: 4,
+      pixel: function (i) { return [(i % 10) * 20, 50, 100, 0]; } },
+    { name: 'graya, opaque', type: 'graya', colorType: 0, depth: 8,
+      pixel: function (i) { return [i & 0xFF, 0, 0, 0]; } },
+    // All transparent pixels have a color no visible pixel has, which
+    // becomes the tRNS color key.
+    { name: 'rgba with a key', type: 'rgba', colorType: 2, depth: 8,
+      pixel: function (i) { return i % 9 == 0 ? [1, 2, 3, 255] : color(i * 2 + 1).concat(0); } },
+    // More gray and alpha pairs than a palette holds.
+    { name: 'translucent gray in rgba', type: 'rgba', colorType: 4, depth: 8,
+      pixel: function (i) { var v = i & 0xFF; return [v, v, v, (i >> 3) % 200]; } },
+    { name: 'translucent gray in bgra', type: 'bgra', colorType: 4, depth: 8,
+      pixel: function (i) { var v = i * 3 & 0xFF; return [v, v, v, (i >> 2) % 150]; } },
+    { name: 'translucent rgba', type: 'rgba', colorType: 6, depth: 8,
+      pixel: function (i) { return color(i).concat(i % 7 * 30); } }
+];
+
+cases.forEach(function (c) {
+    var buf = image(c.type, c.pixel);
+    var png = new PngLib.Png(buf, WIDTH, HEIGHT, c.type).encodeSync({ reduce: true });
+    decode(png, c.type, function (err, img) {
+        if (err) {
+            console.log("Error: " + c.name + ": " + err.message);
+            process.exit(1);
+        }
+        if (img.colorType != c.colorType || img.depth != c.depth) {
+            console.log("Error: " + c.name + " was written as color type " + img.colorType +
+                " at " + img.depth + " bits");
+            process.exit(1);
+        }
+        if (firstDifference(img.pixels, buf) >= 0) {
+            console.log("Error: " + c.name + " decodes to other pixels");
+            process.exit(1);
+        }
+        console.log(c.name + ": " + png.length + " bytes, color type " + img.colorType +
+            " at " + img.depth + " bits, pixels match");
+    });
+});
@@ -0,0 +1,71 @@
+var PngLib = require('../build/Release/png');
+var fs = require('fs');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var cached = new PngLib.FixedPngStack(720, 400, 'rgba', { stripCache: true, filters: 'none' });
+var uncached = new PngLib.FixedPngStack(720, 400, 'rgba', { filters: 'none' });
+
+var files = fs.readdirSync('./push-data');
+var half = Math.floor(files.length / 2);
+
+function pushFiles(list) {
+    list.forEach(function(file) {
+        var dim = rectDim(file);
+        var rgba = fs.readFileSync('./push-data/' + file);
+        cached.push(rgba, dim.x, dim.y, dim.w, dim.h);
+        uncached.push(rgba, dim.x, dim.y, dim.w, dim.h);
+    });
+}
+
+// The second encode only recompresses the strips the second half touched.
+pushFiles(files.slice(0, half));
+var first = cached.encodeSync();
+var firstUncached = uncached.encodeSync();
+pushFiles(files.slice(half));
+
+var start = process.hrtime();
+var a = cached.encodeSync();
+var t = process.hrtime(start);
+var b = uncached.encodeSync();
+
+fs.writeFileSync('strip-cache.png', a.toString('binary'), 'binary');
+fs.writeFileSync('strip-cache-off.png', b.toString('binary'), 'binary');
+
+console.log("cached: " + a.length + " bytes in " + (t[1] / 1e6).toFixed(2) +
+    " ms, uncached: " + b.length + " bytes");
+
+// Both encodes of the cached stack must inflate to the canvas the
+// uncached one has.
+function compare(name, png, expected) {
+    decode(expected, 'rgba', function (err, want) {
+        if (err) {
+            console.log("Error: uncached " + name + ": " + err.message);
+            process.exit(1);
+        }
+        decode(png, 'rgba', function (err, got) {
+            if (err) {
+                console.log("Error: cached " + name + ": " + err.message);
+                process.exit(1);
+            }
+            var i = firstDifference(got.pixels, want.pixels);
+            if (i >= 0) {
+                console.log("Error: cached " + name + " differs from the uncached one at byte " + i);
+                process.exit(1);
+            }
+            console.log(name + ": pixels match");
+        });
+    });
+}
+
+compare('first encode', first, firstUncached);
+compare('second encode', a, b);
@@ -0,0 +1,75 @@
+var PngLib = require('../build/Release/png');
+var Buffer = require('buffer').Buffer;
+var decode = require('./png-decode').decode;
+var firstDifference = require('./png-decode').firstDifference;
+
+// The PNGs are handed over in the Buffers they were encoded in. Check that
+// each one decodes to its pixels, and that it's still intact after the
+// next encodes and a garbage collection, if node runs with --expose-gc.
+var WIDTH = 320, HEIGHT = 200;
+
+function pixels(channels, seed) {
+    var buf = new Buffer(WIDTH * HEIGHT * channels);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = ((i * seed) ^ (i >> 8)) & 0xFF;
+    return buf;
+}
+
+var rgba = pixels(4, 7), rgb = pixels(3, 13);
+
+var fixed = new PngLib.FixedPngStack(WIDTH, HEIGHT, 'rgba');
+fixed.push(rgba, 0, 0, WIDTH, HEIGHT);
+var dynamic = new PngLib.DynamicPngStack('rgb');
+dynamic.push(rgb, 10, 20, WIDTH, HEIGHT);
+
+var results = [];
+function check(name, data, type, expected) {
+    results.push({ name: name, data: data, copy: new Buffer(data), type: type, expected: expected });
+}
+
+check('Png rgba', new PngLib.Png(rgba, WIDTH, HEIGHT, 'rgba').encodeSync(), 'rgba', rgba);
+check('Png rgb', new PngLib.Png(rgb, WIDTH, HEIGHT, 'rgb').encodeSync(), 'rgb', rgb);
+check('FixedPngStack', fixed.encodeSync(), 'rgba', rgba);
+check('DynamicPngStack', dynamic.encodeSync(), 'rgb', rgb);
+
+var pending = 2;
+new PngLib.Png(rgba, WIDTH, HEIGHT, 'rgba').encode(function (data, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    check('Png async', data, 'rgba', rgba);
+    if (--pending == 0)
+        verify();
+});
+fixed.encode(function (data, error) {
+    if (error) {
+        console.log("Error: " + error);
+        process.exit(1);
+    }
+    check('FixedPngStack async', data, 'rgba', rgba);
+    if (--pending == 0)
+        verify();
+});
+
+function verify() {
+    if (typeof gc == 'function')
+        gc();
+    results.forEach(function (r) {
+        if (!Buffer.isBuffer(r.data) || firstDifference(r.data, r.copy) >= 0) {
+            console.log("Error: the " + r.name + " PNG changed after it was returned");
+            process.exit(1);
+        }
+        decode(r.data, r.type, function (err, img) {
+            if (err) {
+                console.log("Error: " + r.name + ": " + err.message);
+                process.exit(1);
+            }
+            if (firstDifference(img.pixels, r.expected) >= 0) {
+                console.log("Error: " + r.name + " decodes to other pixels");
+                process.exit(1);
+            }
+            console.log(r.name + ": " + r.data.length + " bytes, pixels match");
+        });
+    });
+}